@@ -17,6 +17,7 @@
 
 #include "ac_fte.h"
 #include "region_manager.hpp" 
+#include "protected_heap.hpp"
 
 extern "C" {
 #include <stdio.h>
@@ -25,20 +26,51 @@ extern "C" {
 }
 
 #include <fstream>
+#include <atomic>
 
 // Memory region manager
 static region_manager *m = NULL;
 
+// Backs pmalloc()/pfree() with slabs in the default group
+static protected_heap *heap = NULL;
+
+// Named checkpoint groups, each with a region manager of its own; slot 0 stands for m
+static const unsigned int MAX_GROUPS = 16;
+static region_manager *groups[MAX_GROUPS];
+static std::atomic<unsigned int> no_groups(1);
+static std::string group_path_prefix;
+static boost::uint64_t group_cow_mem, group_flush_bandwidth;
+static bool group_aflag, group_lflag, group_afflag, group_nflag;
+static unsigned int group_mtbf, group_speculate_window, group_trace_size;
+static std::string group_trace_path;
+
 static boost::mutex alloc_lock;
 
 static struct sigaction old_handler;
 
 static void handler(int sig, siginfo_t *si, void *unused) {
-    if (si->si_code == SEGV_ACCERR && m && m->handle_segfault(si->si_addr))
-	return;
+    if (si->si_code == SEGV_ACCERR && m) {
+	region_manager *owner = m;
+	unsigned int count = no_groups.load(std::memory_order_acquire);
+	for (unsigned int i = 1; i < count; i++)
+	    if (groups[i]->tracks(si->si_addr)) {
+		owner = groups[i];
+		break;
+	    }
+	if (owner->handle_segfault(si->si_addr))
+	    return;
+    }
     old_handler.sa_sigaction(sig, si, unused);
 }
 
+static region_manager *get_group(int group) {
+    if (group == 0)
+	return m;
+    if (group < 0 || (unsigned int)group >= no_groups.load(std::memory_order_acquire))
+	return NULL;
+    return groups[group];
+}
+
 void __attribute__ ((constructor)) blobcr_constructor() {
 }
 
@@ -46,9 +78,11 @@ void __attribute__ ((destructor)) blobcr_destructor() {
 }
 
 extern "C" void start_checkpointer() {
-    std::string ckpt_path_prefix, ckpt_log_prefix;
-    unsigned cow_size; 
-    bool iflag, aflag, dflag, gdflag;
+    std::string ckpt_path_prefix, ckpt_log_prefix, ckpt_spill_path, ckpt_local_prefix, ckpt_partner_path, ckpt_trace_path;
+    unsigned cow_size, spill_size, urgent_window, speculate_window, local_capacity, drain_bandwidth, flush_bandwidth, partner_size;
+    unsigned ec_group_size, ec_parity, shared_group_size, shared_aggregators, heap_arena_size, touched_log_size;
+    unsigned mtbf, flush_wave, fs_bandwidth, trace_size;
+    bool iflag, aflag, lflag, dflag, gdflag, hdflag, drflag, pflag, sflag, fflag, afflag, nflag;
 
     char *str = getenv("CKPT_PATH_PREFIX");
     if (str != NULL)
@@ -66,20 +100,186 @@ extern "C" void start_checkpointer() {
     if (str == NULL || sscanf(str, "%u", &cow_size) != 1) 
 	cow_size = 27;
 
+    str = getenv("CKPT_SPILL_PATH");
+    if (str != NULL)
+	ckpt_spill_path = std::string(str);
+    else
+	ckpt_spill_path = "";
+
+    str = getenv("CKPT_MAX_SPILL_SIZE");
+    if (str == NULL || sscanf(str, "%u", &spill_size) != 1)
+	spill_size = 30;
+
+    // directory of the per-rank fault and flush traces (blobcr-trace-<rank>.dat), empty disables them
+    str = getenv("CKPT_TRACE_PATH");
+    if (str != NULL)
+	ckpt_trace_path = std::string(str);
+    else
+	ckpt_trace_path = "";
+
+    // trace events buffered between two checkpoints, log2
+    str = getenv("CKPT_TRACE_SIZE");
+    if (str == NULL || sscanf(str, "%u", &trace_size) != 1)
+	trace_size = 20;
+
+    str = getenv("CKPT_LOCAL_PREFIX");
+    if (str != NULL)
+	ckpt_local_prefix = std::string(str);
+    else
+	ckpt_local_prefix = "";
+
+    str = getenv("CKPT_LOCAL_CAPACITY");
+    if (str == NULL || sscanf(str, "%u", &local_capacity) != 1)
+	local_capacity = 34;
+
+    // MB/s, 0 means unthrottled
+    str = getenv("CKPT_DRAIN_BANDWIDTH");
+    if (str == NULL || sscanf(str, "%u", &drain_bandwidth) != 1)
+	drain_bandwidth = 0;
+
+    // MB/s for the checkpoint flush itself, 0 means unthrottled
+    str = getenv("CKPT_FLUSH_BANDWIDTH");
+    if (str == NULL || sscanf(str, "%u", &flush_bandwidth) != 1)
+	flush_bandwidth = 0;
+
+    // ranks admitted to the file system at once, 0 means all of them
+    str = getenv("CKPT_FLUSH_WAVE");
+    if (str == NULL || sscanf(str, "%u", &flush_wave) != 1)
+	flush_wave = 0;
+
+    // MB/s the file system sustains for all ranks together, sizes the waves from measurements
+    str = getenv("CKPT_FS_BANDWIDTH");
+    if (str == NULL || sscanf(str, "%u", &fs_bandwidth) != 1)
+	fs_bandwidth = 0;
+
+    str = getenv("CKPT_PARTNER_PATH");
+    if (str != NULL)
+	ckpt_partner_path = std::string(str);
+    else
+	ckpt_partner_path = "/tmp";
+
+    str = getenv("CKPT_MAX_PARTNER_SIZE");
+    if (str == NULL || sscanf(str, "%u", &partner_size) != 1)
+	partner_size = 30;
+
+    // 0 disables erasure coding
+    str = getenv("EC_GROUP_SIZE");
+    if (str == NULL || sscanf(str, "%u", &ec_group_size) != 1)
+	ec_group_size = 0;
+
+    str = getenv("EC_PARITY");
+    if (str == NULL || sscanf(str, "%u", &ec_parity) != 1)
+	ec_parity = 1;
+
+    // ranks per shared checkpoint file, 0 means all of them
+    str = getenv("CKPT_SHARED_GROUP");
+    if (str == NULL || sscanf(str, "%u", &shared_group_size) != 1)
+	shared_group_size = 0;
+
+    // MPI-IO aggregators per shared file, 0 leaves the choice to MPI
+    str = getenv("CKPT_SHARED_AGGREGATORS");
+    if (str == NULL || sscanf(str, "%u", &shared_aggregators) != 1)
+	shared_aggregators = 0;
+
+    str = getenv("CKPT_HEAP_ARENA_SIZE");
+    if (str == NULL || sscanf(str, "%u", &heap_arena_size) != 1)
+	heap_arena_size = 24;
+
+    // per-thread first-write log entries, log2
+    str = getenv("CKPT_TOUCHED_LOG_SIZE");
+    if (str == NULL || sscanf(str, "%u", &touched_log_size) != 1)
+	touched_log_size = 16;
+
+    // seconds, enables checkpoint_if_due(); 0 leaves scheduling to the application
+    str = getenv("CKPT_MTBF");
+    if (str == NULL || sscanf(str, "%u", &mtbf) != 1)
+	mtbf = 0;
+
+    str = getenv("CKPT_URGENT_WINDOW");
+    if (str == NULL || sscanf(str, "%u", &urgent_window) != 1)
+	urgent_window = 0;
+
+    // most pages unprotected ahead of a sequential or strided fault stream, 0 disables it
+    str = getenv("CKPT_SPECULATE_WINDOW");
+    if (str == NULL || sscanf(str, "%u", &speculate_window) != 1)
+	speculate_window = 0;
+
     str = getenv("INCREMENTAL_FLAG");
     iflag = (str != NULL && strcasecmp(str, "true") == 0);
 
     str = getenv("ACCESS_ORDER_FLAG");
     aflag = (str != NULL && strcasecmp(str, "true") == 0);
 
+    str = getenv("LEARNED_ORDER_FLAG");
+    lflag = (str != NULL && strcasecmp(str, "true") == 0);
+
+    str = getenv("PARTNER_FLAG");
+    pflag = (str != NULL && strcasecmp(str, "true") == 0);
+
+    str = getenv("SHARED_FILE_FLAG");
+    sflag = (str != NULL && strcasecmp(str, "true") == 0);
+
     str = getenv("DEDUP_FLAG");
     dflag = (str != NULL && strcasecmp(str, "true") == 0);
 
     str = getenv("GLOBAL_DEDUP_FLAG");
     gdflag = (str != NULL && strcasecmp(str, "true") == 0);
 
+    str = getenv("HIERARCHICAL_DEDUP_FLAG");
+    hdflag = (str != NULL && strcasecmp(str, "true") == 0);
+
+    str = getenv("DEDUP_REPORT_FLAG");
+    drflag = (str != NULL && strcasecmp(str, "true") == 0);
+
+    str = getenv("FORK_SNAPSHOT_FLAG");
+    fflag = (str != NULL && strcasecmp(str, "true") == 0);
+
+    str = getenv("ADAPTIVE_FLUSH_FLAG");
+    afflag = (str != NULL && strcasecmp(str, "true") == 0);
+
+    str = getenv("NUMA_FLAG");
+    nflag = (str != NULL && strcasecmp(str, "true") == 0);
+
     m = new region_manager(getpagesize(), ckpt_path_prefix, ckpt_log_prefix,
-			   (boost::uint64_t)1 << cow_size, iflag, aflag, dflag, gdflag);
+			   (boost::uint64_t)1 << cow_size, iflag, aflag, lflag, dflag, gdflag);
+    group_path_prefix = ckpt_path_prefix;
+    group_cow_mem = (boost::uint64_t)1 << cow_size;
+    group_aflag = aflag;
+    group_lflag = lflag;
+    group_flush_bandwidth = (boost::uint64_t)flush_bandwidth << 20;
+    group_afflag = afflag;
+    group_nflag = nflag;
+    group_mtbf = mtbf;
+    group_speculate_window = speculate_window;
+    group_trace_path = ckpt_trace_path;
+    group_trace_size = trace_size;
+    if (ckpt_trace_path != "" && !m->enable_trace(ckpt_trace_path, (unsigned long)1 << trace_size))
+	ERROR("could not create the trace in " << ckpt_trace_path << ", continuing without it");
+    m->set_touched_log_size((unsigned long)1 << touched_log_size);
+    m->set_urgent_window(urgent_window);
+    m->set_speculation(speculate_window);
+    m->set_dedup_report(drflag);
+    if (hdflag && !m->enable_hierarchical_dedup())
+	ERROR("hierarchical dedup requested but global dedup is disabled, ignored");
+    m->set_flush_bandwidth((boost::uint64_t)flush_bandwidth << 20, afflag);
+    m->enable_scheduler(mtbf);
+    if (pflag && !m->enable_partner_copy(ckpt_partner_path, (boost::uint64_t)1 << partner_size))
+	ERROR("could not set up partner copies, continuing without them");
+    if (ec_group_size > 0 && !m->enable_erasure_coding(ec_group_size, ec_parity))
+	ERROR("could not set up erasure coding, continuing without it");
+    if (ckpt_local_prefix != "")
+	m->enable_local_tier(ckpt_local_prefix, (boost::uint64_t)1 << local_capacity,
+			     (boost::uint64_t)drain_bandwidth << 20);
+    if (sflag && !m->enable_shared_file(shared_group_size, shared_aggregators))
+	ERROR("could not set up shared checkpoint files, continuing with one file per rank");
+    if (ckpt_spill_path != "" && !m->enable_spill(ckpt_spill_path, (boost::uint64_t)1 << spill_size))
+	ERROR("could not set up COW spill area in " << ckpt_spill_path << ", continuing without it");
+    if ((flush_wave > 0 || fs_bandwidth > 0) && !m->enable_stagger(flush_wave, (double)fs_bandwidth * (1 << 20)))
+	ERROR("could not set up staggered flushes, continuing with all ranks at once");
+    if (fflag && !m->enable_fork_snapshot())
+	ERROR("could not set up fork snapshots, continuing with write tracking");
+    if (nflag && !m->enable_numa())
+	ERROR("only one NUMA node, continuing without NUMA placement");
 
     struct sigaction sa;
     sa.sa_flags = SA_SIGINFO | SA_RESTART;
@@ -88,13 +288,42 @@ extern "C" void start_checkpointer() {
     if (sigaction(SIGSEGV, &sa, &old_handler) == -1) {
 	perror("BlobCR sigaction failure");
 	delete m;
-    } else
+	m = NULL;
+    } else {
+	heap = new protected_heap(m, getpagesize(), (size_t)1 << heap_arena_size);
 	INFO("INIT: ckpt_path_prefix = " << ckpt_path_prefix 
 	     << ", cow_size = " << cow_size
+	     << ", spill_path = " << ckpt_spill_path
+	     << ", spill_size = " << spill_size
+	     << ", urgent_window = " << urgent_window
+	     << ", speculate_window = " << speculate_window
+	     << ", trace_path = " << ckpt_trace_path
+	     << ", trace_size = " << trace_size
+	     << ", mtbf = " << mtbf
+	     << ", touched_log_size = " << touched_log_size
+	     << ", heap_arena_size = " << heap_arena_size
+	     << ", local_prefix = " << ckpt_local_prefix
+	     << ", local_capacity = " << local_capacity
+	     << ", drain_bandwidth = " << drain_bandwidth
+	     << ", flush_bandwidth = " << flush_bandwidth
+	     << ", flush_wave = " << flush_wave
+	     << ", fs_bandwidth = " << fs_bandwidth
+	     << ", ec_group_size = " << ec_group_size
+	     << ", ec_parity = " << ec_parity
+	     << ", shared_group_size = " << shared_group_size
+	     << ", shared_aggregators = " << shared_aggregators
 	     << ", iflag = " << iflag
 	     << ", aflag = " << aflag
+	     << ", lflag = " << lflag
 	     << ", dflag = " << dflag
-	     << ", gdflag = " << gdflag);
+	     << ", gdflag = " << gdflag
+	     << ", fflag = " << fflag
+	     << ", afflag = " << afflag
+	     << ", nflag = " << nflag
+	     << ", drflag = " << drflag
+	     << ", pflag = " << pflag
+	     << ", sflag = " << sflag);
+    }
 }
 
 extern "C" void *add_region(void *addr, size_t size) {
@@ -106,6 +335,18 @@ extern "C" void *add_region(void *addr, size_t size) {
 extern "C" void remove_region(void *addr, size_t size) {
     if (m)
 	m->remove_region(addr, size);
+    for (unsigned int i = 1; i < no_groups.load(std::memory_order_acquire); i++)
+	groups[i]->remove_region(addr, size);
+}
+
+// the syscall overrides call this before the kernel writes into user memory, which would
+// fail with EFAULT on a write protected page instead of faulting
+extern "C" void prefault_protected(void *buff, size_t size) {
+    if (m == NULL)
+	return;
+    m->prefault(buff, size);
+    for (unsigned int i = 1; i < no_groups.load(std::memory_order_acquire); i++)
+	groups[i]->prefault(buff, size);
 }
 
 extern "C" void *malloc_protected(size_t size) {
@@ -123,12 +364,24 @@ extern "C" void *malloc_protected(size_t size) {
 }
 
 extern "C" void free_protected(void *buff, size_t size) {
-    if (m)
-	m->remove_region(buff, size);
+    remove_region(buff, size);
     if (size > 0)
 	munmap(buff, size);
 }
 
+extern "C" void *pmalloc(size_t size) {
+    if (heap)
+	return heap->malloc(size);
+    else
+	return malloc(size);
+}
+
+// pointers from before start_checkpointer() came from malloc()
+extern "C" void pfree(void *ptr) {
+    if (heap == NULL || !heap->free(ptr))
+	free(ptr);
+}
+
 extern "C" int checkpoint() {
     if (m)
 	return (int)m->checkpoint();
@@ -136,21 +389,180 @@ extern "C" int checkpoint() {
 	return 0;
 }
 
+extern "C" int checkpoint_async(checkpoint_callback_t callback, void *arg) {
+    if (m)
+	return m->checkpoint_async(callback, arg);
+    else
+	return -1;
+}
+
+extern "C" int checkpoint_if_due(checkpoint_callback_t callback, void *arg) {
+    if (m)
+	return m->checkpoint_if_due(callback, arg);
+    else
+	return -1;
+}
+
+extern "C" int checkpoint_test(int id) {
+    if (m)
+	return (int)m->checkpoint_test(id);
+    else
+	return 1;
+}
+
+extern "C" void checkpoint_wait(int id) {
+    if (m)
+	m->checkpoint_wait(id);
+}
+
 extern "C" void display_stats() {
     if (m)
 	m->display_stats();
 }
 
+extern "C" int get_checkpoint_stats(struct acfte_stats *stats) {
+    if (stats == NULL)
+	return 0;
+    ckpt_stats::collect(stats);
+    return 1;
+}
+
 extern "C" void wait_for_checkpoint() {
     if (m)
 	m->wait_for_completion();
 }
 
+extern "C" int get_drained_checkpoint() {
+    if (m)
+	return m->get_drained_checkpoint();
+    else
+	return -1;
+}
+
+extern "C" void wait_for_drain() {
+    if (m)
+	m->wait_for_drain();
+}
+
+extern "C" int restore_partner_checkpoint(int seq, const char *path) {
+    if (m)
+	return (int)m->restore_partner_copy(seq, std::string(path));
+    else
+	return 0;
+}
+
+extern "C" int restore_dedup_checkpoint(int seq, const char *path) {
+    if (m)
+	return (int)m->restore_deduplicated(seq, std::string(path));
+    else
+	return 0;
+}
+
+extern "C" int rebuild_checkpoint(int seq) {
+    if (m)
+	return (int)m->rebuild_erasure_coded(seq);
+    else
+	return 0;
+}
+
+extern "C" int create_group(const char *name, int flags) {
+    boost::mutex::scoped_lock lock(alloc_lock);
+    unsigned int id = no_groups.load(std::memory_order_relaxed);
+
+    if (m == NULL || name == NULL || *name == 0 || id == MAX_GROUPS)
+	return -1;
+    std::string no_log = "";
+    region_manager *group = new region_manager(getpagesize(), group_path_prefix, no_log, group_cow_mem,
+					       flags & ACFTE_GROUP_INCREMENTAL, group_aflag, group_lflag,
+					       flags & ACFTE_GROUP_DEDUP, flags & ACFTE_GROUP_GLOBAL_DEDUP);
+    group->set_group_name(name);
+    group->set_flush_bandwidth(group_flush_bandwidth, group_afflag);
+    group->set_speculation(group_speculate_window);
+    if (group_trace_path != "")
+	group->enable_trace(group_trace_path, (unsigned long)1 << group_trace_size);
+    if (group_nflag)
+	group->enable_numa();
+    group->enable_scheduler(group_mtbf);
+    groups[id] = group;
+    no_groups.store(id + 1, std::memory_order_release);
+    INFO("GROUP: id = " << id << ", name = " << name << ", flags = " << flags);
+    return id;
+}
+
+extern "C" void *add_group_region(int group, void *addr, size_t size) {
+    region_manager *g = get_group(group);
+    if (g && size % getpagesize() == 0 && addr != MAP_FAILED)
+	g->add_region(addr, size);
+    return addr;
+}
+
+extern "C" void *malloc_protected_group(int group, size_t size) {
+    region_manager *g = get_group(group);
+    size_t extended_size = size - (size % getpagesize());
+
+    if (g == NULL)
+	return NULL;
+    if (extended_size < size)
+	extended_size += getpagesize();
+    void *buff = mmap(NULL, extended_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (buff == MAP_FAILED)
+	return NULL;
+    g->add_region(buff, extended_size);
+    return buff;
+}
+
+extern "C" int checkpoint_group(int group) {
+    region_manager *g = get_group(group);
+    if (g)
+	return (int)g->checkpoint();
+    else
+	return 0;
+}
+
+extern "C" int checkpoint_group_async(int group, checkpoint_callback_t callback, void *arg) {
+    region_manager *g = get_group(group);
+    if (g)
+	return g->checkpoint_async(callback, arg);
+    else
+	return -1;
+}
+
+extern "C" int checkpoint_group_if_due(int group, checkpoint_callback_t callback, void *arg) {
+    region_manager *g = get_group(group);
+    if (g)
+	return g->checkpoint_if_due(callback, arg);
+    else
+	return -1;
+}
+
+extern "C" int checkpoint_group_test(int group, int id) {
+    region_manager *g = get_group(group);
+    if (g)
+	return (int)g->checkpoint_test(id);
+    else
+	return 1;
+}
+
+extern "C" void checkpoint_group_wait(int group, int id) {
+    region_manager *g = get_group(group);
+    if (g)
+	g->checkpoint_wait(id);
+}
+
 extern "C" void terminate_checkpointer() {
+    delete heap;
+    heap = NULL;
+    unsigned int count = no_groups.exchange(1);
+    for (unsigned int i = count - 1; i > 0; i--) {
+	groups[i]->display_stats();
+	delete groups[i];
+    }
     if (m) {
 	sigaction(SIGSEGV, &old_handler, NULL);
 	m->display_stats();
-	delete m;
+	// unpublished first, the syscall overrides of other threads check it
+	region_manager *last = m;
 	m = NULL;
+	delete last;
     }
 }
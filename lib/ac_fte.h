@@ -24,6 +24,35 @@ extern "C" {
 
 #include <sys/types.h>
 
+#define ACFTE_HIST_BUCKETS 32
+
+enum acfte_fault_type {
+    ACFTE_FAULT_WAIT, ACFTE_FAULT_COW, ACFTE_FAULT_SPILL, ACFTE_FAULT_AFTER, ACFTE_FAULT_DELAYED,
+    ACFTE_FAULT_TYPES
+};
+
+// cumulative since start_checkpointer(); histogram bucket i counts events of [2^i, 2^(i+1)) ns
+struct acfte_stats {
+    unsigned long long checkpoints;
+    unsigned long long faults[ACFTE_FAULT_TYPES];
+    unsigned long long fault_latency[ACFTE_FAULT_TYPES][ACFTE_HIST_BUCKETS];
+    unsigned long long flush_latency[ACFTE_HIST_BUCKETS];
+    unsigned long long pages_flushed, bytes_written;
+    unsigned long long cow_pages_in_use, cow_pages_peak, cow_pages_capacity;
+    unsigned long long spill_pages_in_use, spill_pages_peak, spill_pages_capacity;
+    unsigned long long setup_ns, dedup_local_ns, dedup_global_ns;
+    // pages of this rank in the last deduplicated checkpoint: processed, locally unique, globally owned
+    unsigned long long dedup_pages_total, dedup_pages_local, dedup_pages_global;
+    // pages unprotected ahead of a sequential or strided fault stream, without a fault of their own
+    unsigned long long pages_speculated;
+};
+
+typedef void (*checkpoint_callback_t)(int id, void *arg);
+
+#define ACFTE_GROUP_INCREMENTAL   1
+#define ACFTE_GROUP_DEDUP         2
+#define ACFTE_GROUP_GLOBAL_DEDUP  4
+
 void start_checkpointer();
 void terminate_checkpointer();
 
@@ -31,12 +60,82 @@ void *add_region(void *addr, size_t size);
 void remove_region(void *addr, size_t size);
 void *malloc_protected(size_t size);
 void free_protected(void *ptr, size_t size);
+// small protected objects packed into tracked slabs of the default group, released with
+// terminate_checkpointer(), so free them (and containers using protected_allocator) before
+void *pmalloc(size_t size);
+void pfree(void *ptr);
 int checkpoint();
+// returns the id of the started checkpoint once its pages are protected, or -1;
+// the callback (may be NULL) runs on the writer thread when the checkpoint is complete,
+// before checkpoint_wait() returns; it must not wait for checkpoints itself
+int checkpoint_async(checkpoint_callback_t callback, void *arg);
+// with CKPT_MTBF: starts checkpoint_async() once the Young/Daly interval has passed since the last
+// checkpoint, returns -1 otherwise or while the previous checkpoint is still flushing; call it at
+// safe points. The interval follows the estimated cost of checkpointing the dirty pages, less what
+// the current dirtying rate would add over any interval. It is collective: all ranks call it at the
+// same safe points and checkpoint together once the interval has passed on any of them and none is
+// still flushing. Every call costs a blocking all-reduce of one int over all ranks, so call it at
+// safe points far enough apart for that latency not to matter (e.g. once per outer iteration)
+int checkpoint_if_due(checkpoint_callback_t callback, void *arg);
+int checkpoint_test(int id);
+void checkpoint_wait(int id);
 void wait_for_checkpoint();
+// with CKPT_LOCAL_PREFIX: sequence number of the last checkpoint copied to CKPT_PATH_PREFIX (-1 if none)
+int get_drained_checkpoint();
+void wait_for_drain();
+// collective with PARTNER_FLAG: fetch this rank's image of checkpoint seq back from its buddy into path
+int restore_partner_checkpoint(int seq, const char *path);
+// collective with DEDUP_FLAG: rebuild this rank's image of checkpoint seq into path in flush order,
+// the pages it references (blobcr-refs-<rank>-<seq>.dat) restored in place at their flush positions
+// from the files of their owners, its own pages filling the positions in between
+int restore_dedup_checkpoint(int seq, const char *path);
+// collective with EC_GROUP_SIZE: rebuild missing local images of checkpoint seq from the group parity
+int rebuild_checkpoint(int seq);
 void display_stats();
+int get_checkpoint_stats(struct acfte_stats *stats);
+
+// named region groups with their own policy (ACFTE_GROUP_* flags), sequence numbers and files
+// (blobcr-ckpt-<name>-<rank>-<seq>.dat), checkpointed independently of each other; group 0 is
+// the default one configured through the environment. remove_region() and free_protected()
+// apply to every group. Each group gets its own communicator, so every rank has to create the
+// same groups in the same order.
+int create_group(const char *name, int flags);
+void *add_group_region(int group, void *addr, size_t size);
+void *malloc_protected_group(int group, size_t size);
+int checkpoint_group(int group);
+int checkpoint_group_async(int group, checkpoint_callback_t callback, void *arg);
+int checkpoint_group_if_due(int group, checkpoint_callback_t callback, void *arg);
+int checkpoint_group_test(int group, int id);
+void checkpoint_group_wait(int group, int id);
 
 #ifdef __cplusplus
 }
+
+#include <cstddef>
+#include <new>
+
+// STL allocator placing container storage in checkpointed memory through pmalloc()
+template <class T> struct protected_allocator {
+    typedef T value_type;
+
+    protected_allocator() { }
+    template <class U> protected_allocator(const protected_allocator<U> &) { }
+
+    T *allocate(std::size_t n) {
+	void *ptr = pmalloc(n * sizeof(T));
+	if (ptr == NULL)
+	    throw std::bad_alloc();
+	return (T *)ptr;
+    }
+    void deallocate(T *ptr, std::size_t) {
+	pfree(ptr);
+    }
+};
+
+template <class T, class U>
+bool operator==(const protected_allocator<T> &, const protected_allocator<U> &) { return true; }
+template <class T, class U>
+bool operator!=(const protected_allocator<T> &, const protected_allocator<U> &) { return false; }
 #endif
 
 #endif
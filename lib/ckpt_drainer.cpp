@@ -0,0 +1,156 @@
+/*******************************************************************************
+ Author: Bogdan Nicolae
+ Copyright (C) 2013 IBM Corp.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*******************************************************************************/
+
+#include "ckpt_drainer.hpp"
+
+extern "C" {
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+}
+
+//#define __DEBUG
+#include "common/debug.hpp"
+
+// copy granularity, also the unit of throttling
+#define DRAIN_CHUNK_SIZE (1 << 22)
+// ioprio_set(IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_IDLE)
+#define IOPRIO_IDLE_CLASS (3 << 13)
+
+ckpt_drainer::ckpt_drainer(boost::uint64_t cap, boost::uint64_t bw) :
+    capacity(cap), bandwidth(bw), local_usage(0), last_drained(-1), shutdown(false),
+    drain_thread(boost::bind(&ckpt_drainer::drain_exec, this)) { }
+
+ckpt_drainer::~ckpt_drainer() {
+    // finish what was submitted, local copies are not durable
+    {
+	boost::mutex::scoped_lock lock(drain_lock);
+	shutdown = true;
+	drain_cond.notify_all();
+    }
+    drain_thread.join();
+}
+
+void ckpt_drainer::submit(int seq_no, const std::string &local_name, const std::string &remote_name) {
+    struct stat st;
+    boost::uint64_t size = stat(local_name.c_str(), &st) == 0 ? st.st_size : 0;
+
+    boost::mutex::scoped_lock lock(drain_lock);
+    pending.push_back(drain_entry_t(seq_no, local_name, remote_name, size));
+    local_usage += size;
+    drain_cond.notify_all();
+}
+
+int ckpt_drainer::get_last_drained() {
+    boost::mutex::scoped_lock lock(drain_lock);
+    return last_drained;
+}
+
+void ckpt_drainer::wait_for_drain() {
+    boost::mutex::scoped_lock lock(drain_lock);
+    while (!pending.empty())
+	drain_cond.wait(lock);
+}
+
+bool ckpt_drainer::copy_file(const drain_entry_t &e) {
+    std::string part_name = e.remote_name + ".part";
+    int in_fd = open(e.local_name.c_str(), O_RDONLY);
+    if (in_fd == -1) {
+	perror(("drain open " + e.local_name).c_str());
+	return false;
+    }
+    int out_fd = open(part_name.c_str(), O_WRONLY | O_TRUNC | O_CREAT, 0666);
+    if (out_fd == -1) {
+	perror(("drain open " + part_name).c_str());
+	close(in_fd);
+	return false;
+    }
+
+    boost::posix_time::ptime start(boost::posix_time::microsec_clock::local_time());
+    off_t offset = 0;
+    bool ok = true;
+    while ((boost::uint64_t)offset < e.size) {
+	ssize_t result = sendfile(out_fd, in_fd, &offset, std::min((boost::uint64_t)DRAIN_CHUNK_SIZE, e.size - offset));
+	if (result <= 0) {
+	    perror(("drain copy " + e.local_name).c_str());
+	    ok = false;
+	    break;
+	}
+	if (bandwidth > 0) {
+	    boost::uint64_t expected_us = offset * 1000000 / bandwidth;
+	    boost::uint64_t elapsed_us = (boost::posix_time::microsec_clock::local_time() - start).total_microseconds();
+	    if (expected_us > elapsed_us)
+		usleep(expected_us - elapsed_us);
+	}
+    }
+    close(in_fd);
+    if (fsync(out_fd) == -1 || close(out_fd) == -1)
+	ok = false;
+    // readers of the durable prefix only ever see complete images
+    if (ok && rename(part_name.c_str(), e.remote_name.c_str()) == -1)
+	ok = false;
+    if (!ok)
+	unlink(part_name.c_str());
+    return ok;
+}
+
+void ckpt_drainer::evict() {
+    while (local_usage > capacity && !drained.empty()) {
+	unlink(drained.front().local_name.c_str());
+	local_usage -= drained.front().size;
+	drained.pop_front();
+    }
+}
+
+void ckpt_drainer::drain_exec() {
+    // stay out of the way of the application and of the local checkpoint writer
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+    syscall(SYS_ioprio_set, 1, syscall(SYS_gettid), IOPRIO_IDLE_CLASS | 7);
+
+    while (1) {
+	drain_entry_t e(-1, "", "", 0);
+	{
+	    boost::mutex::scoped_lock lock(drain_lock);
+	    while (pending.empty() && !shutdown)
+		drain_cond.wait(lock);
+	    if (pending.empty())
+		return;
+	    e = pending.front();
+	}
+	TIMER_START(drain_timer);
+	bool ok = copy_file(e);
+	TIMER_STOP(drain_timer, "drained " << e.local_name << " to " << e.remote_name);
+	{
+	    boost::mutex::scoped_lock lock(drain_lock);
+	    pending.pop_front();
+	    if (ok) {
+		last_drained = e.seq_no;
+		drained.push_back(e);
+	    } else {
+		// keep the only copy around, it just does not count against the cache anymore
+		ERROR("could not drain " << e.local_name << ", local copy kept");
+		local_usage -= e.size;
+	    }
+	    evict();
+	    drain_cond.notify_all();
+	}
+    }
+}
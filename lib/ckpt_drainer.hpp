@@ -0,0 +1,62 @@
+/*******************************************************************************
+ Author: Bogdan Nicolae
+ Copyright (C) 2013 IBM Corp.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*******************************************************************************/
+
+#ifndef __CKPT_DRAINER
+#define __CKPT_DRAINER
+
+#include <string>
+#include <deque>
+
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
+
+// Copies checkpoints completed on a fast local tier to the durable prefix in the background
+class ckpt_drainer {
+private:
+    struct drain_entry_t {
+	int seq_no;
+	std::string local_name, remote_name;
+	boost::uint64_t size;
+	drain_entry_t(int s, const std::string &l, const std::string &r, boost::uint64_t sz) :
+	    seq_no(s), local_name(l), remote_name(r), size(sz) { }
+    };
+
+    boost::uint64_t capacity, bandwidth, local_usage;
+    // pending: waiting to be copied, drained: copied but still cached locally
+    std::deque<drain_entry_t> pending, drained;
+    int last_drained;
+    bool shutdown;
+
+    boost::mutex drain_lock;
+    boost::condition_variable drain_cond;
+    boost::thread drain_thread;
+
+    void drain_exec();
+    bool copy_file(const drain_entry_t &e);
+    void evict();
+
+public:
+    ckpt_drainer(boost::uint64_t capacity, boost::uint64_t bandwidth);
+    ~ckpt_drainer();
+
+    void submit(int seq_no, const std::string &local_name, const std::string &remote_name);
+    int get_last_drained();
+    void wait_for_drain();
+};
+
+#endif
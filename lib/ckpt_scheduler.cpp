@@ -0,0 +1,84 @@
+/*******************************************************************************
+ Author: Bogdan Nicolae
+ Copyright (C) 2013 IBM Corp.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*******************************************************************************/
+
+#include "ckpt_scheduler.hpp"
+
+#include <cmath>
+#include <algorithm>
+
+const double ckpt_scheduler::COST_WEIGHT = 0.5;
+
+ckpt_scheduler::ckpt_scheduler(double mtbf_s) :
+    mtbf(mtbf_s), setup_time(0), page_time(0), dirty_rate(0), last_start(0), last_setup(0),
+    sample_time(0), sample_pages(0), measured(false) {
+}
+
+void ckpt_scheduler::started(boost::uint64_t start_ns, boost::uint64_t setup_ns) {
+    boost::mutex::scoped_lock lock(sched_lock);
+    last_start = start_ns;
+    last_setup = setup_ns;
+    // the dirty count starts over, so does its rate
+    sample_time = 0;
+    dirty_rate = 0;
+    setup_time = measured ? COST_WEIGHT * setup_ns / 1e9 + (1 - COST_WEIGHT) * setup_time : setup_ns / 1e9;
+}
+
+void ckpt_scheduler::completed(boost::uint64_t end_ns, unsigned long pages) {
+    boost::mutex::scoped_lock lock(sched_lock);
+    if (pages > 0) {
+	double t = (end_ns - last_start - last_setup) / 1e9 / pages;
+	page_time = measured ? COST_WEIGHT * t + (1 - COST_WEIGHT) * page_time : t;
+    }
+    measured = true;
+}
+
+// seconds a checkpoint of the given number of pages would take, setup and flush
+double ckpt_scheduler::cost(unsigned long dirty_pages) {
+    boost::mutex::scoped_lock lock(sched_lock);
+    return setup_time + dirty_pages * page_time;
+}
+
+// Daly's higher order estimate of the optimal compute time between checkpoints, for the cost the
+// interval cannot amortize; called with sched_lock held
+double ckpt_scheduler::effective_interval(unsigned long dirty_pages, boost::uint64_t now_ns) {
+    double elapsed = now_ns > last_start ? (now_ns - last_start) / 1e9 : 0;
+    double c = std::max(setup_time, setup_time + (dirty_pages - elapsed * dirty_rate) * page_time);
+    if (c >= 2 * mtbf)
+	return mtbf;
+    return std::sqrt(2 * c * mtbf) * (1 + std::sqrt(c / (2 * mtbf)) / 3 + c / (9 * 2 * mtbf)) - c;
+}
+
+double ckpt_scheduler::interval(unsigned long dirty_pages, boost::uint64_t now_ns) {
+    boost::mutex::scoped_lock lock(sched_lock);
+    return effective_interval(dirty_pages, now_ns);
+}
+
+// the first checkpoint is always due, it provides the first cost measurement
+bool ckpt_scheduler::due(unsigned long dirty_pages, boost::uint64_t now_ns) {
+    boost::mutex::scoped_lock lock(sched_lock);
+    if (!measured)
+	return true;
+    // the rate over roughly the last quarter of the time since the checkpoint started, long
+    // enough to smooth out bursts between safe points, short enough to follow phase changes
+    if (sample_time != 0 && now_ns > sample_time && 4 * (now_ns - sample_time) >= now_ns - last_start)
+	dirty_rate = dirty_pages > sample_pages ? (dirty_pages - sample_pages) * 1e9 / (now_ns - sample_time) : 0;
+    if (sample_time == 0 || 4 * (now_ns - sample_time) >= now_ns - last_start) {
+	sample_time = now_ns;
+	sample_pages = dirty_pages;
+    }
+    return (now_ns - last_start) / 1e9 >= effective_interval(dirty_pages, now_ns);
+}
@@ -0,0 +1,53 @@
+/*******************************************************************************
+ Author: Bogdan Nicolae
+ Copyright (C) 2013 IBM Corp.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*******************************************************************************/
+
+#ifndef __CKPT_SCHEDULER
+#define __CKPT_SCHEDULER
+
+#include <boost/cstdint.hpp>
+#include <boost/thread/mutex.hpp>
+
+// Young/Daly checkpoint interval for a given MTBF. The cost of a checkpoint is estimated from
+// the setup and per-page flush times measured so far and the pages dirtied since the last one.
+// As that cost grows with the interval itself, the interval is derived from the intercept of its
+// tangent, C(t) - t * C'(t), with C' taken from the current dirtying rate: pages dirtied at a
+// steady rate cost the same per unit of time whatever the interval and do not stretch it, only
+// the part of the cost a longer interval does not amortize (setup, a saturated working set) does.
+class ckpt_scheduler {
+private:
+    // weight of the latest checkpoint in the running cost estimates
+    static const double COST_WEIGHT;
+
+    double mtbf, setup_time, page_time, dirty_rate;
+    boost::uint64_t last_start, last_setup, sample_time;
+    unsigned long sample_pages;
+    bool measured;
+    boost::mutex sched_lock;
+
+    double effective_interval(unsigned long dirty_pages, boost::uint64_t now_ns);
+
+public:
+    ckpt_scheduler(double mtbf_s);
+
+    void started(boost::uint64_t start_ns, boost::uint64_t setup_ns);
+    void completed(boost::uint64_t end_ns, unsigned long pages);
+    double cost(unsigned long dirty_pages);
+    double interval(unsigned long dirty_pages, boost::uint64_t now_ns);
+    bool due(unsigned long dirty_pages, boost::uint64_t now_ns);
+};
+
+#endif
@@ -0,0 +1,126 @@
+/*******************************************************************************
+ Author: Bogdan Nicolae
+ Copyright (C) 2013 IBM Corp.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*******************************************************************************/
+
+#include "ckpt_stats.hpp"
+
+#include <cstring>
+
+extern "C" {
+#include <time.h>
+}
+
+ckpt_stats::shard_t ckpt_stats::shards[ckpt_stats::MAX_SHARDS];
+std::atomic<unsigned int> ckpt_stats::next_shard(0);
+__thread ckpt_stats::shard_t *ckpt_stats::local = NULL;
+std::atomic<long long> ckpt_stats::gauges[ckpt_stats::GAUGE_TYPES], ckpt_stats::peaks[ckpt_stats::GAUGE_TYPES];
+std::atomic<boost::uint64_t> ckpt_stats::capacities[ckpt_stats::GAUGE_TYPES], ckpt_stats::dedup[3];
+
+ckpt_stats::shard_t *ckpt_stats::get_shard() {
+    if (local == NULL) {
+	unsigned int index = next_shard.fetch_add(1, std::memory_order_relaxed);
+	// threads beyond the preallocated shards share the last one
+	local = &shards[index < MAX_SHARDS ? index : MAX_SHARDS - 1];
+    }
+    return local;
+}
+
+void ckpt_stats::add(std::atomic<boost::uint64_t> &c, boost::uint64_t v, shard_t *s) {
+    if (s == &shards[MAX_SHARDS - 1])
+	c.fetch_add(v, std::memory_order_relaxed);
+    else
+	c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+unsigned int ckpt_stats::bucket(boost::uint64_t ns) {
+    unsigned int b = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+    return b < ACFTE_HIST_BUCKETS ? b : ACFTE_HIST_BUCKETS - 1;
+}
+
+boost::uint64_t ckpt_stats::now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (boost::uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void ckpt_stats::count(counter_t c, boost::uint64_t v) {
+    shard_t *s = get_shard();
+    add(s->counters[c], v, s);
+}
+
+void ckpt_stats::record_fault(int type, boost::uint64_t ns) {
+    shard_t *s = get_shard();
+    add(s->faults[type][bucket(ns)], 1, s);
+}
+
+void ckpt_stats::record_flush(boost::uint64_t ns) {
+    shard_t *s = get_shard();
+    add(s->flushes[bucket(ns)], 1, s);
+}
+
+void ckpt_stats::gauge_add(gauge_t g, long long delta) {
+    long long v = gauges[g].fetch_add(delta, std::memory_order_relaxed) + delta;
+    long long p = peaks[g].load(std::memory_order_relaxed);
+    while (v > p && !peaks[g].compare_exchange_weak(p, v, std::memory_order_relaxed));
+}
+
+void ckpt_stats::set_capacity(gauge_t g, boost::uint64_t capacity) {
+    capacities[g].store(capacity, std::memory_order_relaxed);
+}
+
+void ckpt_stats::set_dedup(boost::uint64_t total, boost::uint64_t local, boost::uint64_t global) {
+    dedup[0].store(total, std::memory_order_relaxed);
+    dedup[1].store(local, std::memory_order_relaxed);
+    dedup[2].store(global, std::memory_order_relaxed);
+}
+
+void ckpt_stats::collect(struct acfte_stats *out) {
+    boost::uint64_t counters[COUNTER_TYPES];
+
+    memset(out, 0, sizeof(struct acfte_stats));
+    memset(counters, 0, sizeof(counters));
+    unsigned int used = next_shard.load(std::memory_order_relaxed);
+    if (used > MAX_SHARDS)
+	used = MAX_SHARDS;
+    for (unsigned int i = 0; i < used; i++) {
+	for (unsigned int c = 0; c < COUNTER_TYPES; c++)
+	    counters[c] += shards[i].counters[c].load(std::memory_order_relaxed);
+	for (unsigned int t = 0; t < ACFTE_FAULT_TYPES; t++)
+	    for (unsigned int b = 0; b < ACFTE_HIST_BUCKETS; b++) {
+		boost::uint64_t v = shards[i].faults[t][b].load(std::memory_order_relaxed);
+		out->fault_latency[t][b] += v;
+		out->faults[t] += v;
+	    }
+	for (unsigned int b = 0; b < ACFTE_HIST_BUCKETS; b++)
+	    out->flush_latency[b] += shards[i].flushes[b].load(std::memory_order_relaxed);
+    }
+    out->checkpoints = counters[CHECKPOINTS];
+    out->pages_flushed = counters[PAGES_FLUSHED];
+    out->bytes_written = counters[BYTES_WRITTEN];
+    out->setup_ns = counters[SETUP_NS];
+    out->dedup_local_ns = counters[DEDUP_LOCAL_NS];
+    out->dedup_global_ns = counters[DEDUP_GLOBAL_NS];
+    out->pages_speculated = counters[PAGES_SPECULATED];
+    out->cow_pages_in_use = gauges[COW_PAGES].load(std::memory_order_relaxed);
+    out->cow_pages_peak = peaks[COW_PAGES].load(std::memory_order_relaxed);
+    out->cow_pages_capacity = capacities[COW_PAGES].load(std::memory_order_relaxed);
+    out->spill_pages_in_use = gauges[SPILL_PAGES].load(std::memory_order_relaxed);
+    out->spill_pages_peak = peaks[SPILL_PAGES].load(std::memory_order_relaxed);
+    out->spill_pages_capacity = capacities[SPILL_PAGES].load(std::memory_order_relaxed);
+    out->dedup_pages_total = dedup[0].load(std::memory_order_relaxed);
+    out->dedup_pages_local = dedup[1].load(std::memory_order_relaxed);
+    out->dedup_pages_global = dedup[2].load(std::memory_order_relaxed);
+}
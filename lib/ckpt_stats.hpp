@@ -0,0 +1,69 @@
+/*******************************************************************************
+ Author: Bogdan Nicolae
+ Copyright (C) 2013 IBM Corp.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*******************************************************************************/
+
+#ifndef __CKPT_STATS
+#define __CKPT_STATS
+
+#include <atomic>
+#include <boost/cstdint.hpp>
+
+#include "ac_fte.h"
+
+// Counters and latency histograms for get_checkpoint_stats(). Every thread updates a shard
+// of its own with relaxed loads and stores, so the fault handler never synchronizes;
+// shards are preallocated and claimed once per thread, which is async-signal-safe.
+class ckpt_stats {
+public:
+    enum counter_t {
+	CHECKPOINTS, PAGES_FLUSHED, BYTES_WRITTEN, SETUP_NS, DEDUP_LOCAL_NS, DEDUP_GLOBAL_NS,
+	PAGES_SPECULATED, COUNTER_TYPES
+    };
+    enum gauge_t {
+	COW_PAGES, SPILL_PAGES, GAUGE_TYPES
+    };
+
+    static void count(counter_t c, boost::uint64_t v = 1);
+    static void record_fault(int type, boost::uint64_t ns);
+    static void record_flush(boost::uint64_t ns);
+    static void gauge_add(gauge_t g, long long delta);
+    static void set_capacity(gauge_t g, boost::uint64_t capacity);
+    static void set_dedup(boost::uint64_t total, boost::uint64_t local, boost::uint64_t global);
+    static boost::uint64_t now_ns();
+    static void collect(struct acfte_stats *out);
+
+private:
+    static const unsigned int MAX_SHARDS = 128;
+
+    struct shard_t {
+	std::atomic<boost::uint64_t> counters[COUNTER_TYPES];
+	std::atomic<boost::uint64_t> faults[ACFTE_FAULT_TYPES][ACFTE_HIST_BUCKETS];
+	std::atomic<boost::uint64_t> flushes[ACFTE_HIST_BUCKETS];
+    } __attribute__ ((aligned (64)));
+
+    static shard_t shards[MAX_SHARDS];
+    static std::atomic<unsigned int> next_shard;
+    static __thread shard_t *local;
+
+    static std::atomic<long long> gauges[GAUGE_TYPES], peaks[GAUGE_TYPES];
+    static std::atomic<boost::uint64_t> capacities[GAUGE_TYPES], dedup[3];
+
+    static shard_t *get_shard();
+    static void add(std::atomic<boost::uint64_t> &c, boost::uint64_t v, shard_t *s);
+    static unsigned int bucket(boost::uint64_t ns);
+};
+
+#endif
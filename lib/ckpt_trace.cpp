@@ -0,0 +1,115 @@
+/*******************************************************************************
+ Author: Bogdan Nicolae
+ Copyright (C) 2013 IBM Corp.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*******************************************************************************/
+
+#include "ckpt_trace.hpp"
+
+#include <vector>
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+}
+
+#define __DEBUG
+#include "common/debug.hpp"
+
+static std::atomic<unsigned int> next_thread(0);
+static __thread int trace_thread = -1;
+
+ckpt_trace::ckpt_trace(const std::string &file_name, unsigned long cap) :
+    slots(NULL), capacity(cap), next(0), dumped(0) {
+    fd = open(file_name.c_str(), O_WRONLY | O_TRUNC | O_CREAT, 0666);
+    if (fd == -1)
+	return;
+    // zero filled, so no slot claims to hold an event yet
+    slots = (slot_t *)mmap(NULL, capacity * sizeof(slot_t), PROT_READ | PROT_WRITE,
+			   MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if (slots == MAP_FAILED) {
+	close(fd);
+	fd = -1;
+	slots = NULL;
+    }
+}
+
+ckpt_trace::~ckpt_trace() {
+    if (fd == -1)
+	return;
+    dump();
+    close(fd);
+    munmap(slots, capacity * sizeof(slot_t));
+}
+
+void ckpt_trace::record(boost::uint8_t event, boost::uint8_t type, const void *addr,
+			boost::uint64_t value, boost::uint64_t stamp) {
+    if (trace_thread < 0)
+	trace_thread = next_thread.fetch_add(1, std::memory_order_relaxed);
+    boost::uint64_t idx = next.fetch_add(1, std::memory_order_relaxed);
+    slot_t &slot = slots[idx % capacity];
+    // invalidate first, a dump racing with the overwrite then drops the slot instead of tearing it
+    slot.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.rec.stamp = stamp;
+    slot.rec.addr = (unsigned long)addr;
+    slot.rec.value = value > 0xffffffffULL ? 0xffffffffU : (boost::uint32_t)value;
+    slot.rec.thread = trace_thread;
+    slot.rec.event = event;
+    slot.rec.type = type;
+    slot.seq.store(idx + 1, std::memory_order_release);
+}
+
+void ckpt_trace::dump() {
+    std::vector<record_t> out;
+    boost::uint64_t lost = 0, end = next.load(std::memory_order_acquire);
+
+    if (end - dumped > capacity) {
+	lost = end - capacity - dumped;
+	dumped = end - capacity;
+    }
+    out.reserve(end - dumped + 1);
+    out.push_back(record_t());
+    for (; dumped < end; dumped++) {
+	slot_t &slot = slots[dumped % capacity];
+	boost::uint64_t seq = slot.seq.load(std::memory_order_acquire);
+	// still being stored, picked up by the next dump
+	if (seq != 0 && seq < dumped + 1)
+	    break;
+	record_t rec = slot.rec;
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (seq != dumped + 1 || slot.seq.load(std::memory_order_relaxed) != seq) {
+	    if (seq == 0)
+		break;
+	    lost++;
+	    continue;
+	}
+	out.push_back(rec);
+    }
+    out[0].event = TRACE_LOST;
+    out[0].value = lost > 0xffffffffULL ? 0xffffffffU : (boost::uint32_t)lost;
+    out[0].stamp = out.size() > 1 ? out[1].stamp : 0;
+    unsigned int first = lost > 0 ? 0 : 1;
+    const char *buff = (const char *)(out.data() + first);
+    size_t size = (out.size() - first) * sizeof(record_t), progress = 0;
+    while (progress < size) {
+	ssize_t result = write(fd, buff + progress, size - progress);
+	if (result == -1) {
+	    ERROR("cannot append to the trace file");
+	    return;
+	}
+	progress += result;
+    }
+}
@@ -0,0 +1,82 @@
+/*******************************************************************************
+ Author: Bogdan Nicolae
+ Copyright (C) 2013 IBM Corp.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*******************************************************************************/
+
+#ifndef __CKPT_TRACE
+#define __CKPT_TRACE
+
+#include <string>
+#include <atomic>
+#include <boost/cstdint.hpp>
+
+// Binary trace of faults, page commits and checkpoints for offline replay (test/trace_replay).
+// Events go into a preallocated ring without locks, so the fault handler can record them;
+// the writer appends what accumulated to the trace file at the end of every checkpoint.
+// Events overwritten before being dumped are lost, and counted in a TRACE_LOST event.
+class ckpt_trace {
+public:
+    enum event_t {
+	// addr = COW budget in pages, value = page size, type = TRACE_* policy flags
+	TRACE_START = 1,
+	// addr = start, value = pages
+	REGION_ADD, REGION_REMOVE,
+	// the application resumes: value = scheduled pages
+	CKPT_BEGIN,
+	// addr = page, value = handling ns, type = ACFTE_FAULT_* or FAULT_SPECULATED
+	FAULT,
+	// addr = page, value = write ns, type = 1 if dropped by dedup
+	COMMIT,
+	// value = pages written
+	CKPT_END,
+	// value = events overwritten in the ring since the last dump
+	TRACE_LOST
+    };
+    static const boost::uint8_t TRACE_INCREMENTAL = 1, TRACE_ACCESS_ORDER = 2, TRACE_LEARNED_ORDER = 4;
+    // a page handled ahead of a fault stream, without faulting itself
+    static const boost::uint8_t FAULT_SPECULATED = 0xff;
+
+    struct record_t {
+	boost::uint64_t stamp, addr;
+	boost::uint32_t value;
+	boost::uint16_t thread;
+	boost::uint8_t event, type;
+    };
+
+private:
+    struct slot_t {
+	record_t rec;
+	// index + 1 of the event last stored in the slot
+	std::atomic<boost::uint64_t> seq;
+    };
+
+    int fd;
+    slot_t *slots;
+    unsigned long capacity;
+    std::atomic<boost::uint64_t> next;
+    boost::uint64_t dumped;
+
+public:
+    ckpt_trace(const std::string &file_name, unsigned long capacity);
+    ~ckpt_trace();
+
+    bool good() { return fd != -1; }
+    void record(boost::uint8_t event, boost::uint8_t type, const void *addr,
+		boost::uint64_t value, boost::uint64_t stamp);
+    // single consumer: the writer, or the owner once the writer is gone
+    void dump();
+};
+
+#endif
@@ -16,26 +16,48 @@
 *******************************************************************************/
 
 #include "cow_allocator.hpp"
+#include "numa_policy.hpp"
 
 extern "C" {
+#include <unistd.h>
+#include <stdio.h>
 #include <sys/mman.h>
 }
 
+#include <string>
+
 char *no_reclaim_allocator::region;
 size_t no_reclaim_allocator::current_size, no_reclaim_allocator::max_size;
+unsigned int no_reclaim_allocator::users = 0;
 boost::mutex no_reclaim_allocator::alloc_lock;
 
 char *simple_sweep_allocator::region, *simple_sweep_allocator::alloc_bitmap;
 size_t simple_sweep_allocator::page_size, simple_sweep_allocator::max_size;
+unsigned int simple_sweep_allocator::users = 0, simple_sweep_allocator::nodes = 1;
 boost::mutex simple_sweep_allocator::alloc_lock;
 
+char *spill_allocator::region = NULL, *spill_allocator::alloc_bitmap = NULL;
+size_t spill_allocator::page_size, spill_allocator::max_size = 0;
+int spill_allocator::fd = -1;
+boost::mutex spill_allocator::alloc_lock;
+
+// every region manager (one per checkpoint group) shares the same regions: the first one
+// to initialize them sets their size and the last one to go away releases them; groups may
+// come and go from different threads, so the count is kept under the allocation lock
+
 void no_reclaim_allocator::init(size_type ms) {
+    boost::mutex::scoped_lock lock(alloc_lock);
+    if (users++ > 0)
+	return;
     max_size = ms;
     current_size = 0;
     region = (char *)mmap(NULL, max_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
 }
 
 void simple_sweep_allocator::init(size_type ps, size_type em) {
+    boost::mutex::scoped_lock lock(alloc_lock);
+    if (users++ > 0)
+	return;
     max_size = em;
     page_size = ps;
     region = (char *)mmap(NULL, em, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
@@ -44,17 +66,24 @@ void simple_sweep_allocator::init(size_type ps, size_type em) {
 }
 
 void no_reclaim_allocator::destroy() {
+    boost::mutex::scoped_lock lock(alloc_lock);
+    if (--users > 0)
+	return;
     munmap(region, max_size);    
 }
 
 void simple_sweep_allocator::destroy() {
+    boost::mutex::scoped_lock lock(alloc_lock);
+    if (--users > 0)
+	return;
     munmap(region, max_size);
     munmap(alloc_bitmap, max_size / page_size);
+    nodes = 1;
 }
 
 char *no_reclaim_allocator::malloc(const size_type size) {
     char *result = NULL;
-    boost::mutex::scoped_lock(alloc_lock);
+    boost::mutex::scoped_lock lock(alloc_lock);
     if (current_size + size <= max_size) {
 	result = region + current_size;
 	current_size += size;
@@ -68,10 +97,91 @@ void no_reclaim_allocator::free(char *const addr) {
     DBG("this is not implemented!");
 }
 
-char *simple_sweep_allocator::malloc(const size_type size) { 
-    boost::mutex::scoped_lock(alloc_lock);
+// one slice of the region per node, each placed on its node
+void simple_sweep_allocator::split_nodes(unsigned int n) {
+    boost::mutex::scoped_lock lock(alloc_lock);
+    size_t slice = (max_size / page_size / n) * page_size;
+    if (slice == 0)
+	return;
+    for (unsigned int i = 0; i < n; i++)
+	numa_policy::prefer(region + i * slice, slice, i);
+    nodes = n;
+}
+
+// sweeps the slice of the given node first and falls back to the others
+char *simple_sweep_allocator::malloc(const size_type size, int node) { 
+    boost::mutex::scoped_lock lock(alloc_lock);
+    unsigned int total = max_size / page_size, start = 0;
+    if (node > 0 && (unsigned int)node < nodes)
+	start = node * (total / nodes);
+    for (unsigned int i = 0; i < total; i++) {
+	unsigned int index = (start + i) % total;
+	if (alloc_bitmap[index] == 0) {
+	    alloc_bitmap[index] = 1;
+	    return region + index * page_size;
+	}
+    }
+    return NULL;
+}
+
+size_t simple_sweep_allocator::get_page_size() {
+    return simple_sweep_allocator::page_size;
+}
+
+void simple_sweep_allocator::free(char *const addr) {
+    boost::mutex::scoped_lock lock(alloc_lock);
+    unsigned long index = ((unsigned long)addr - (unsigned long)region) / page_size;
+    if (index < max_size / page_size)
+	alloc_bitmap[index] = 0;
+}
+
+bool spill_allocator::init(size_type ps, const char *spill_dir, size_type sm) {
+    std::string name = std::string(spill_dir) + "/acfte-spill-XXXXXX";
+    char *templ = &name[0];
+
+    fd = mkstemp(templ);
+    if (fd == -1) {
+	perror("spill area creation");
+	return false;
+    }
+    // the file is only needed while the process lives
+    unlink(templ);
+    if (ftruncate(fd, sm) == -1) {
+	perror("spill area allocation");
+	close(fd);
+	fd = -1;
+	return false;
+    }
+    region = (char *)mmap(NULL, sm, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (region == MAP_FAILED) {
+	perror("spill area mapping");
+	close(fd);
+	fd = -1;
+	region = NULL;
+	return false;
+    }
+    max_size = sm;
+    page_size = ps;
+    alloc_bitmap = (char *)mmap(NULL, sm / ps, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    memset(alloc_bitmap, 0, sm / ps);
+    return true;
+}
+
+void spill_allocator::destroy() {
+    if (region == NULL)
+	return;
+    munmap(region, max_size);
+    munmap(alloc_bitmap, max_size / page_size);
+    close(fd);
+    region = alloc_bitmap = NULL;
+    fd = -1;
+    max_size = 0;
+}
+
+char *spill_allocator::malloc(const size_type size) {
+    boost::mutex::scoped_lock lock(alloc_lock);
     unsigned int index = 0;
-    while (alloc_bitmap[index] != 0)
+    while (index < max_size / page_size && alloc_bitmap[index] != 0)
 	index++;
     if (index == max_size / page_size)
 	return NULL;
@@ -79,13 +189,13 @@ char *simple_sweep_allocator::malloc(const size_type size) {
     return region + index * page_size;
 }
 
-size_t simple_sweep_allocator::get_page_size() {
-    return simple_sweep_allocator::page_size;
-}
-
-void simple_sweep_allocator::free(char *const addr) {
-    boost::mutex::scoped_lock(alloc_lock);
+void spill_allocator::free(char *const addr) {
+    boost::mutex::scoped_lock lock(alloc_lock);
     unsigned long index = ((unsigned long)addr - (unsigned long)region) / page_size;
     if (index < max_size / page_size)
 	alloc_bitmap[index] = 0;
 }
+
+bool spill_allocator::contains(const char *addr) {
+    return region != NULL && addr >= region && addr < region + max_size;
+}
@@ -30,6 +30,7 @@ struct no_reclaim_allocator {
 
     static char *region;
     static size_t current_size, max_size;
+    static unsigned int users;
     static boost::mutex alloc_lock;
 
     static void init(size_type max_size);
@@ -44,13 +45,32 @@ struct simple_sweep_allocator {
 
     static char *region, *alloc_bitmap;
     static size_t max_size, page_size;
+    static unsigned int users, nodes;
     static boost::mutex alloc_lock;    
 
     static void init(size_type page_size, size_type extra_mem);
     static void destroy();
-    static char *malloc(const size_type size);
+    static void split_nodes(unsigned int nodes);
+    static char *malloc(const size_type size, int node = -1);
     static void free(char *const addr);
     static size_t get_page_size();
 };
 
+// second COW tier: same sweep scheme, backed by an unlinked file on fast local storage
+struct spill_allocator {
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+
+    static char *region, *alloc_bitmap;
+    static size_t max_size, page_size;
+    static int fd;
+    static boost::mutex alloc_lock;
+
+    static bool init(size_type page_size, const char *spill_dir, size_type spill_mem);
+    static void destroy();
+    static char *malloc(const size_type size);
+    static void free(char *const addr);
+    static bool contains(const char *addr);
+};
+
 #endif
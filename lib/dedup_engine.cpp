@@ -23,12 +23,14 @@
 
 #include <openssl/sha.h>
 #include <boost/serialization/boost_unordered_set.hpp>
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/vector.hpp>
 
 #define __DEBUG
 #include "common/debug.hpp"
 
 #define HASH_FCN   SHA1
-#define HASH_SIZE  20
+#define HASH_SIZE  DEDUP_FINGERPRINT_SIZE
 
 // how many top-k pages to keep
 static const unsigned int THRESHOLD = 1 << 17;
@@ -40,10 +42,7 @@ public:
     unsigned int count;
     unsigned int rank;
 
-    page_hashes_entry_t(char *buff, unsigned int r) : count(1), rank(r) {
-	HASH_FCN((unsigned char *)buff, simple_sweep_allocator::get_page_size(), (unsigned char *)hash);
-	page_ptr = buff;
-    }
+    page_hashes_entry_t(char *buff, unsigned int r) : page_ptr(buff), count(1), rank(r) { }
     page_hashes_entry_t() : page_ptr(NULL), count(0), rank(0) { }
     bool operator==(page_hashes_entry_t const& other) const {
 	return memcmp(hash, other.hash, HASH_SIZE) == 0;
@@ -122,8 +121,9 @@ namespace boost {
     } 
 }
 
-dedup_engine::dedup_engine(boost::mpi::communicator *comm) : 
-    stats(0, 0, 0), mpi_comm_world(comm) { }
+dedup_engine::dedup_engine(const boost::mpi::communicator &world) : 
+    cache_flag(false), stats(0, 0, 0), comm(world, boost::mpi::comm_duplicate),
+    hierarchical(false) { }
 
 dedup_engine::~dedup_engine() {
 }
@@ -131,13 +131,35 @@ dedup_engine::~dedup_engine() {
 void dedup_engine::clear() {
     page_ptr_map.clear();
     page_hashes.clear();
+    references.clear();
     stats.total = 0;
 }
 
-void dedup_engine::process_page(char *buff) {
-    auto ret = page_hashes.insert(page_hashes_entry_t(buff, mpi_comm_world->rank()));
+bool dedup_engine::process_page(char *buff, char *content) {
+    page_hashes_entry_t entry(buff, comm.rank());
+    auto fi = cache_flag ? fingerprints.find(buff) : fingerprints.end();
+    if (fi != fingerprints.end())
+	memcpy(entry.hash, fi->second.hash, HASH_SIZE);
+    else {
+	HASH_FCN((unsigned char *)content, simple_sweep_allocator::get_page_size(), (unsigned char *)entry.hash);
+	if (cache_flag)
+	    memcpy(fingerprints[buff].hash, entry.hash, HASH_SIZE);
+    }
+    auto ret = page_hashes.insert(entry);
     page_ptr_map[buff] = ret.second;
+    if (!ret.second) {
+	dedup_ref_t &ref = references[buff];
+	memcpy(ref.fingerprint, entry.hash, HASH_SIZE);
+	ref.owner = entry.rank;
+	ref.offset = DEDUP_NO_OFFSET;
+    }
     stats.total++;
+    return ret.second;
+}
+
+void dedup_engine::set_fingerprint_cache(bool flag) {
+    cache_flag = flag;
+    fingerprints.clear();
 }
 
 bool dedup_engine::check_page(char *buff) {
@@ -148,30 +170,192 @@ void dedup_engine::finalize_local() {
     stats.local = page_hashes.size();
 }
 
+void dedup_engine::enable_hierarchical() {
+    MPI_Comm node;
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, comm.rank(), MPI_INFO_NULL, &node);
+    node_comm = boost::mpi::communicator(node, boost::mpi::comm_take_ownership);
+    // only the leaders get a leader communicator, the others a null one
+    leader_comm = comm.split(node_comm.rank() == 0 ? 0 : MPI_UNDEFINED);
+    boost::mpi::all_gather(node_comm, (unsigned int)comm.rank(), node_ranks);
+    hierarchical = true;
+}
+
+void dedup_engine::node_merge(page_hashes_t &result) {
+    std::vector<unsigned int> counts;
+    boost::mpi::all_gather(node_comm, (unsigned int)page_hashes.size(), counts);
+
+    // every rank publishes its locally unique fingerprints in a window shared by the node
+    MPI_Win win;
+    char *base;
+    MPI_Win_allocate_shared(page_hashes.size() * HASH_SIZE, 1, MPI_INFO_NULL, node_comm, &base, &win);
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+    unsigned int i = 0;
+    for (auto pi = page_hashes.begin(); pi != page_hashes.end(); pi++, i++)
+	memcpy(base + i * HASH_SIZE, pi->hash, HASH_SIZE);
+    MPI_Win_sync(win);
+    MPI_Barrier(node_comm);
+    MPI_Win_sync(win);
+
+    std::vector<char *> segments(node_ranks.size());
+    for (unsigned int r = 0; r < node_ranks.size(); r++) {
+	MPI_Aint size;
+	int disp;
+	MPI_Win_shared_query(win, r, &size, &disp, &segments[r]);
+    }
+
+    // and all of them elect the same owners from the whole table: pages held by a single rank
+    // stay there, the shared ones then go to the holder keeping the fewest pages so far
+    std::vector<page_hashes_entry_t> entries;
+    boost::unordered_map<std::string, unsigned int> index;
+    for (unsigned int r = 0; r < node_ranks.size(); r++)
+	for (unsigned int j = 0; j < counts[r]; j++) {
+	    auto ret = index.insert(std::make_pair(std::string(segments[r] + j * HASH_SIZE, HASH_SIZE), entries.size()));
+	    if (ret.second) {
+		entries.push_back(page_hashes_entry_t(NULL, node_ranks[r]));
+		memcpy(entries.back().hash, segments[r] + j * HASH_SIZE, HASH_SIZE);
+	    } else
+		entries[ret.first->second].count++;
+	}
+    std::vector<unsigned int> owner(entries.size(), node_ranks.size()), load(node_ranks.size(), 0);
+    for (unsigned int r = 0; r < node_ranks.size(); r++)
+	for (unsigned int j = 0; j < counts[r]; j++)
+	    if (entries[index[std::string(segments[r] + j * HASH_SIZE, HASH_SIZE)]].count == 1)
+		load[r]++;
+    for (unsigned int r = 0; r < node_ranks.size(); r++)
+	for (unsigned int j = 0; j < counts[r]; j++) {
+	    unsigned int e = index[std::string(segments[r] + j * HASH_SIZE, HASH_SIZE)];
+	    if (entries[e].count == 1 || (owner[e] < node_ranks.size() && load[owner[e]] <= load[r]))
+		continue;
+	    if (owner[e] < node_ranks.size())
+		load[owner[e]]--;
+	    load[r]++;
+	    owner[e] = r;
+	    entries[e].rank = node_ranks[r];
+	}
+    MPI_Win_unlock_all(win);
+    MPI_Win_free(&win);
+    result.clear();
+    result.insert(entries.begin(), entries.end());
+}
+
+void dedup_engine::hierarchical_merge(page_hashes_t &result) {
+    page_hashes_t inter;
+
+    node_merge(result);
+    // the leaders merge the node-level sets, whose owners are already on the right node
+    if (leader_comm) {
+	inter = result;
+	inter = boost::mpi::all_reduce(leader_comm, inter, hash_merger_t(comm.size()));
+    }
+    boost::mpi::broadcast(node_comm, inter, 0);
+    // fingerprints beyond the top-k of the inter-node pass keep their node owner
+    for (auto ii = inter.begin(); ii != inter.end(); ii++) {
+	result.erase(*ii);
+	result.insert(*ii);
+    }
+}
+
 void dedup_engine::global_dedup() {
-    page_hashes_t merge_result = page_hashes;
-    merge_result = boost::mpi::all_reduce(*mpi_comm_world, merge_result, hash_merger_t(mpi_comm_world->size()));
-    for (auto pi = page_hashes.begin(); pi != page_hashes.end(); pi++) {
+    page_hashes_t merge_result;
+    if (hierarchical)
+	hierarchical_merge(merge_result);
+    else {
+	merge_result = page_hashes;
+	merge_result = boost::mpi::all_reduce(comm, merge_result, hash_merger_t(comm.size()));
+    }
+    for (auto pi = page_hashes.begin(); pi != page_hashes.end(); ) {
 	auto mi = merge_result.find(*pi);
 	if (mi != merge_result.end() && mi->rank != pi->rank) {
 	    page_ptr_map[pi->page_ptr] = false;
-	    page_hashes.erase(pi);
-	}
+	    dedup_ref_t &ref = references[pi->page_ptr];
+	    memcpy(ref.fingerprint, pi->hash, HASH_SIZE);
+	    ref.owner = mi->rank;
+	    ref.offset = DEDUP_NO_OFFSET;
+	    pi = page_hashes.erase(pi);
+	} else
+	    pi++;
+    }
+    // local duplicates of a page given away follow it to its new owner
+    page_hashes_entry_t key;
+    for (auto ri = references.begin(); ri != references.end(); ri++) {
+	if (ri->second.owner != (unsigned int)comm.rank())
+	    continue;
+	memcpy(key.hash, ri->second.fingerprint, HASH_SIZE);
+	if (page_hashes.find(key) != page_hashes.end())
+	    continue;
+	auto mi = merge_result.find(key);
+	if (mi != merge_result.end())
+	    ri->second.owner = mi->rank;
     }
     stats.global = page_hashes.size();
-    if (mpi_comm_world->rank() == 0) {
-	std::vector<unsigned int, boost::fast_pool_allocator<unsigned int, no_reclaim_allocator> > hash_count(mpi_comm_world->size(), 0);
+    if (comm.rank() == 0) {
+	std::vector<unsigned int, boost::fast_pool_allocator<unsigned int, no_reclaim_allocator> > hash_count(comm.size(), 0);
 	for (auto mi = merge_result.begin(); mi != merge_result.end(); mi++)
 	    hash_count[mi->count - 1]++;
-	for (int i = 0; i < mpi_comm_world->size(); i++)
+	for (int i = 0; i < comm.size(); i++)
 	    DBG(hash_count[i] << " hashes have frequency of appearance " << i + 1);
     }
 }
 
+void dedup_engine::resolve_references(const page_offsets_t &written, const page_offsets_t &dropped, bool global,
+				      std::vector<dedup_ref_t> &refs) {
+    unsigned int rank = comm.rank();
+    page_hashes_entry_t key;
+
+    refs.clear();
+    for (auto ri = references.begin(); ri != references.end(); ri++) {
+	// flushed anyway, e.g. on behalf of a blocked thread before the global pass
+	if (written.find(ri->first) != written.end())
+	    continue;
+	refs.push_back(ri->second);
+	auto di = dropped.find(ri->first);
+	refs.back().position = di != dropped.end() ? di->second : DEDUP_NO_OFFSET;
+    }
+    for (unsigned int i = 0; i < refs.size(); i++) {
+	if (refs[i].owner != rank)
+	    continue;
+	memcpy(key.hash, refs[i].fingerprint, HASH_SIZE);
+	auto pi = page_hashes.find(key);
+	if (pi == page_hashes.end())
+	    continue;
+	auto wi = written.find(pi->page_ptr);
+	if (wi != written.end())
+	    refs[i].offset = wi->second;
+    }
+    if (!global)
+	return;
+
+    // ask each owner for the offsets of the fingerprints it kept on behalf of this rank
+    unsigned int size = comm.size();
+    std::vector<std::string> queries(size), requests;
+    std::vector<std::vector<boost::uint64_t> > answers(size), replies;
+    for (unsigned int i = 0; i < refs.size(); i++)
+	if (refs[i].owner != rank)
+	    queries[refs[i].owner].append((const char *)refs[i].fingerprint, HASH_SIZE);
+    boost::mpi::all_to_all(comm, queries, requests);
+    for (unsigned int r = 0; r < size; r++)
+	for (unsigned int j = 0; j + HASH_SIZE <= requests[r].size(); j += HASH_SIZE) {
+	    boost::uint64_t offset = DEDUP_NO_OFFSET;
+	    memcpy(key.hash, requests[r].data() + j, HASH_SIZE);
+	    auto pi = page_hashes.find(key);
+	    if (pi != page_hashes.end()) {
+		auto wi = written.find(pi->page_ptr);
+		if (wi != written.end())
+		    offset = wi->second;
+	    }
+	    answers[r].push_back(offset);
+	}
+    boost::mpi::all_to_all(comm, answers, replies);
+    std::vector<unsigned int> next(size, 0);
+    for (unsigned int i = 0; i < refs.size(); i++)
+	if (refs[i].owner != rank)
+	    refs[i].offset = replies[refs[i].owner][next[refs[i].owner]++];
+}
+
 std::string dedup_engine::get_stats() {
     stats_t out;
-    boost::mpi::reduce(*mpi_comm_world, stats, out, stats_merger_t(), 0);
-    if (mpi_comm_world->rank() == 0) {
+    boost::mpi::reduce(comm, stats, out, stats_merger_t(), 0);
+    if (comm.rank() == 0) {
 	std::ostringstream ss;
 	ss << "local = " << out.local << "/" << out.total << ", global = " << out.global << "/" << out.total;
 	return  ss.str();
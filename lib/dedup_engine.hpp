@@ -26,6 +26,21 @@
 
 #include "cow_allocator.hpp"
 
+#define DEDUP_FINGERPRINT_SIZE 20
+
+// a page left out of a checkpoint file: its content is the page at offset in the checkpoint
+// file of rank owner (possibly this one), and its place in the image without dedup is position
+// (in pages, in flush order); the reference file of a checkpoint is an array of these
+struct dedup_ref_t {
+    unsigned char fingerprint[DEDUP_FINGERPRINT_SIZE];
+    boost::uint32_t owner;
+    boost::uint64_t offset, position;
+};
+static const boost::uint64_t DEDUP_NO_OFFSET = (boost::uint64_t)-1;
+
+// file offsets of the pages the writer did flush, flush positions of the ones it dropped
+typedef boost::unordered_map<char *, boost::uint64_t> page_offsets_t;
+
 class page_hashes_entry_t;
 typedef boost::unordered_set<page_hashes_entry_t,
 			     boost::hash<page_hashes_entry_t>, std::equal_to<page_hashes_entry_t>,
@@ -54,20 +69,50 @@ private:
 			      
     page_hashes_t page_hashes;
     page_ptr_map_t page_ptr_map;
+    // pages dropped as duplicates, with their fingerprint and the rank that keeps the content
+    boost::unordered_map<char *, dedup_ref_t> references;
+    // fingerprints of pages not written since they were hashed, kept across checkpoints
+    struct fingerprint_t {
+	unsigned char hash[DEDUP_FINGERPRINT_SIZE];
+    };
+    boost::unordered_map<char *, fingerprint_t> fingerprints;
+    bool cache_flag;
 
     stats_t stats;
-    boost::mpi::communicator *mpi_comm_world;
+    // private copy of the world communicator: the collectives run on the writer thread,
+    // concurrently with whatever the application does on its own communicators
+    boost::mpi::communicator comm;
+    // two-level dedup: owners are elected among the ranks of a node through shared memory,
+    // only the node-level unique sets are merged across nodes, by one leader per node
+    bool hierarchical;
+    boost::mpi::communicator node_comm, leader_comm;
+    std::vector<unsigned int> node_ranks;
+
+    void node_merge(page_hashes_t &result);
+    void hierarchical_merge(page_hashes_t &result);
    
 public:
-    dedup_engine(boost::mpi::communicator *comm);
+    dedup_engine(const boost::mpi::communicator &world);
     ~dedup_engine();
-    void process_page(char *buff);
+    // content is hashed on behalf of buff, e.g. its copy-on-write snapshot; true if new locally
+    bool process_page(char *buff, char *content);
+    bool process_page(char *buff) { return process_page(buff, buff); }
     bool check_page(char *buff);
+    void set_fingerprint_cache(bool flag);
+    // collective over all ranks
+    void enable_hierarchical();
+    // buff was written (or untracked) since its last fingerprint
+    void invalidate(char *buff) { fingerprints.erase(buff); }
+    bool is_cached(char *buff) { return cache_flag && fingerprints.find(buff) != fingerprints.end(); }
     void global_dedup();
+    // collective after a flush with global dedup: owners map fingerprints to their file offsets
+    void resolve_references(const page_offsets_t &written, const page_offsets_t &dropped, bool global,
+			    std::vector<dedup_ref_t> &refs);
     void clear();
 
     void finalize_local();
     std::string get_stats();
+    const stats_t &get_local_stats() const { return stats; }
 };
 
 #endif
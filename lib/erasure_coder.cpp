@@ -0,0 +1,356 @@
+/*******************************************************************************
+ Author: Bogdan Nicolae
+ Copyright (C) 2013 IBM Corp.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*******************************************************************************/
+
+#include "erasure_coder.hpp"
+
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+
+extern "C" {
+#include <unistd.h>
+#include <fcntl.h>
+}
+
+//#define __DEBUG
+#include "common/debug.hpp"
+
+unsigned char erasure_coder::gf_exp[512], erasure_coder::gf_log[256];
+
+void erasure_coder::gf_init() {
+    unsigned int x = 1;
+    for (unsigned int i = 0; i < 255; i++) {
+	gf_exp[i] = x;
+	gf_log[x] = i;
+	x <<= 1;
+	if (x & 0x100)
+	    x ^= 0x11d;
+    }
+    for (unsigned int i = 255; i < 512; i++)
+	gf_exp[i] = gf_exp[i - 255];
+}
+
+unsigned char erasure_coder::gf_mul(unsigned char a, unsigned char b) {
+    if (a == 0 || b == 0)
+	return 0;
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+unsigned char erasure_coder::gf_inv(unsigned char a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+void erasure_coder::gf_mul_add(unsigned char c, const char *src, char *dst, boost::uint64_t size) {
+    if (c == 1) {
+	for (boost::uint64_t i = 0; i < size; i++)
+	    dst[i] ^= src[i];
+	return;
+    }
+    unsigned char row[256];
+    for (unsigned int i = 0; i < 256; i++)
+	row[i] = gf_mul(c, i);
+    for (boost::uint64_t i = 0; i < size; i++)
+	dst[i] ^= row[(unsigned char)src[i]];
+}
+
+unsigned char erasure_coder::coef(int row, int column) {
+    // a single parity row is plain XOR, otherwise rows of a Cauchy matrix (any square submatrix is invertible)
+    if (m == 1)
+	return 1;
+    return gf_inv(row ^ (m + column));
+}
+
+boost::uint64_t erasure_coder::header_size() {
+    return 2 * sizeof(int) + sizeof(boost::uint64_t) * (k + 1);
+}
+
+erasure_coder::erasure_coder(const boost::mpi::communicator &world, int gk, int gm, boost::uint64_t ss) :
+    m(gm), seg_size(ss), current(0), fill(0), rounds(0), rounds_done(0), stream_size(0),
+    parity_offset(0), parity_fd(-1), parity_ok(true), stats_parity(0) {
+    MPI_Comm node;
+    int leader = world.rank(), color;
+
+    gf_init();
+    // every rank learns the node of every other one, named after the lowest rank it hosts
+    MPI_Comm_split_type(world, MPI_COMM_TYPE_SHARED, world.rank(), MPI_INFO_NULL, &node);
+    boost::mpi::communicator node_comm(node, boost::mpi::comm_take_ownership);
+    boost::mpi::broadcast(node_comm, leader, 0);
+    std::vector<int> nodes;
+    boost::mpi::all_gather(world, leader, nodes);
+    std::vector<int> leaders(nodes);
+    std::sort(leaders.begin(), leaders.end());
+    leaders.erase(std::unique(leaders.begin(), leaders.end()), leaders.end());
+
+    // members of a group sit on different nodes: the ranks with the same index on gk nodes in a row
+    if (leaders.size() == 1) {
+	ERROR("all ranks share the same node, erasure coding will not survive a node failure");
+	color = world.rank() / gk;
+    } else {
+	int node_index = std::lower_bound(leaders.begin(), leaders.end(), leader) - leaders.begin();
+	color = node_comm.rank() * ((leaders.size() + gk - 1) / gk) + node_index / gk;
+    }
+    group = world.split(color, world.rank());
+    k = group.size();
+    me = group.rank();
+    if (k <= m)
+	ERROR("erasure coding group of rank " << world.rank() << " has only " << k
+	      << " members for " << m << " parity rows, disabled");
+    round_size = (k - m) * seg_size;
+    for (unsigned int i = 0; i < 2; i++) {
+	data[i].resize(round_size);
+	send_buf[i].resize(k * m * seg_size);
+	recv_buf[i].resize(m * seg_size);
+	active[i] = false;
+    }
+}
+
+erasure_coder::~erasure_coder() {
+    if (parity_fd != -1)
+	close(parity_fd);
+}
+
+void erasure_coder::submit(unsigned int index) {
+    ASSERT(rounds_done < rounds);
+    memset(&send_buf[index][0], 0, send_buf[index].size());
+    // the block for member d and row j belongs to stripe (d - j) % k, where we may contribute data
+    for (int d = 0; d < k; d++)
+	for (int j = 0; j < m; j++) {
+	    int t = (d - j + k) % k, s = (me - t + k) % k - m;
+	    if (s >= 0)
+		gf_mul_add(coef(j, s), &data[index][s * seg_size],
+			   &send_buf[index][(d * m + j) * seg_size], seg_size);
+	}
+    MPI_Ireduce_scatter_block(&send_buf[index][0], &recv_buf[index][0], m * seg_size, MPI_BYTE,
+			      MPI_BXOR, group, &reqs[index]);
+    active[index] = true;
+    rounds_done++;
+}
+
+void erasure_coder::complete(unsigned int index) {
+    if (!active[index])
+	return;
+    MPI_Wait(&reqs[index], MPI_STATUS_IGNORE);
+    // later rounds are still computed on a failure, the rest of the group depends on them
+    ssize_t ret = pwrite(parity_fd, &recv_buf[index][0], recv_buf[index].size(), parity_offset);
+    if (ret != (ssize_t)recv_buf[index].size() && parity_ok) {
+	ERROR("cannot write parity at offset " << parity_offset);
+	parity_ok = false;
+    }
+    parity_offset += recv_buf[index].size();
+    stats_parity += recv_buf[index].size();
+    active[index] = false;
+}
+
+void erasure_coder::begin(const std::string &parity_name, boost::uint64_t max_size) {
+    boost::uint64_t group_max;
+
+    // every member has to take part in the same number of rounds
+    boost::mpi::all_reduce(group, max_size, group_max, boost::mpi::maximum<boost::uint64_t>());
+    rounds = (group_max + round_size - 1) / round_size;
+    rounds_done = 0;
+    current = 0;
+    fill = 0;
+    stream_size = 0;
+    stats_parity = 0;
+    parity_offset = header_size();
+    parity_fd = open(parity_name.c_str(), O_RDWR | O_TRUNC | O_CREAT, 0666);
+    parity_ok = parity_fd != -1;
+    if (!parity_ok)
+	ERROR("cannot create parity file " << parity_name);
+}
+
+void erasure_coder::push(const char *buff, boost::uint64_t size) {
+    stream_size += size;
+    while (size > 0) {
+	boost::uint64_t len = std::min(size, round_size - fill);
+	memcpy(&data[current][fill], buff, len);
+	fill += len;
+	buff += len;
+	size -= len;
+	if (fill == round_size) {
+	    // the previous round overlaps with filling the next one
+	    submit(current);
+	    current ^= 1;
+	    complete(current);
+	    fill = 0;
+	}
+    }
+}
+
+bool erasure_coder::finish() {
+    while (rounds_done < rounds) {
+	memset(&data[current][fill], 0, round_size - fill);
+	submit(current);
+	current ^= 1;
+	complete(current);
+	fill = 0;
+    }
+    ASSERT(fill == 0);
+    complete(current ^ 1);
+
+    // the header records the stream sizes, so that survivors can rebuild any member
+    std::vector<boost::uint64_t> sizes;
+    boost::mpi::all_gather(group, stream_size, sizes);
+    std::vector<char> header(header_size());
+    memcpy(&header[0], &k, sizeof(int));
+    memcpy(&header[sizeof(int)], &m, sizeof(int));
+    memcpy(&header[2 * sizeof(int)], &seg_size, sizeof(boost::uint64_t));
+    memcpy(&header[2 * sizeof(int) + sizeof(boost::uint64_t)], &sizes[0], k * sizeof(boost::uint64_t));
+    if (parity_ok && pwrite(parity_fd, &header[0], header.size(), 0) != (ssize_t)header.size()) {
+	ERROR("cannot write the parity header");
+	parity_ok = false;
+    }
+    if (parity_fd != -1)
+	close(parity_fd);
+    parity_fd = -1;
+    return parity_ok;
+}
+
+bool erasure_coder::rebuild(const std::string &image_name, const std::string &parity_name) {
+    int image_fd = open(image_name.c_str(), O_RDONLY), fd = open(parity_name.c_str(), O_RDONLY);
+    std::vector<char> header(header_size());
+    bool lost = image_fd == -1 || fd == -1 ||
+	pread(fd, &header[0], header.size(), 0) != (ssize_t)header.size() ||
+	memcmp(&header[0], &k, sizeof(int)) != 0 || memcmp(&header[sizeof(int)], &m, sizeof(int)) != 0;
+
+    std::vector<int> lost_flags;
+    boost::mpi::all_gather(group, (int)lost, lost_flags);
+    int nlost = std::count(lost_flags.begin(), lost_flags.end(), 1);
+    if (nlost == 0 || nlost > m) {
+	if (nlost > m)
+	    ERROR(nlost << " members of the group lost their images, only " << m << " can be rebuilt");
+	if (image_fd != -1)
+	    close(image_fd);
+	if (fd != -1)
+	    close(fd);
+	return nlost == 0;
+    }
+
+    int root = std::find(lost_flags.begin(), lost_flags.end(), 0) - lost_flags.begin();
+    boost::mpi::broadcast(group, &header[0], header.size(), root);
+    boost::uint64_t seg, max_size = 0;
+    std::vector<boost::uint64_t> sizes(k);
+    memcpy(&seg, &header[2 * sizeof(int)], sizeof(boost::uint64_t));
+    memcpy(&sizes[0], &header[2 * sizeof(int) + sizeof(boost::uint64_t)], k * sizeof(boost::uint64_t));
+    for (int i = 0; i < k; i++)
+	max_size = std::max(max_size, sizes[i]);
+    boost::uint64_t rsize = (k - m) * seg, nrounds = (max_size + rsize - 1) / rsize;
+
+    std::vector<char> contrib(k * seg), gathered, syndrome, result(seg);
+    int out_fd = -1;
+    bool ok = true;
+    if (lost) {
+	if (image_fd != -1)
+	    close(image_fd);
+	gathered.resize(k * k * seg);
+	out_fd = open(image_name.c_str(), O_WRONLY | O_TRUNC | O_CREAT, 0666);
+	ok = out_fd != -1;
+    }
+    // every round takes part in the gathers even after an error, the other members wait for them
+    for (boost::uint64_t r = 0; r < nrounds; r++) {
+	if (!lost) {
+	    memset(&contrib[0], 0, contrib.size());
+	    if (ok && (pread(image_fd, &contrib[0], rsize, r * rsize) == -1 ||
+		       pread(fd, &contrib[rsize], m * seg, header.size() + r * m * seg) != (ssize_t)(m * seg))) {
+		ERROR("cannot read round " << r << " of " << image_name << " or its parity");
+		ok = false;
+	    }
+	}
+	for (int l = 0; l < k; l++)
+	    if (lost_flags[l])
+		MPI_Gather(&contrib[0], k * seg, MPI_BYTE, lost ? &gathered[0] : NULL,
+			   k * seg, MPI_BYTE, l, group);
+	if (!lost)
+	    continue;
+	for (int s = 0; s < k - m; s++) {
+	    // solve stripe t for the lost data columns using the surviving parity rows
+	    int t = (me - s - m + 2 * k) % k;
+	    std::vector<int> unknown, rows;
+	    for (int x = 0; x < k - m; x++)
+		if (lost_flags[(t + m + x) % k])
+		    unknown.push_back(x);
+	    for (int j = 0; j < m && rows.size() < unknown.size(); j++)
+		if (!lost_flags[(t + j) % k])
+		    rows.push_back(j);
+	    ASSERT(rows.size() == unknown.size());
+	    unsigned int u = unknown.size();
+	    syndrome.assign(u * seg, 0);
+	    for (unsigned int a = 0; a < u; a++) {
+		int h = (t + rows[a]) % k;
+		memcpy(&syndrome[a * seg], &gathered[h * k * seg + (k - m + rows[a]) * seg], seg);
+		for (int x = 0; x < k - m; x++) {
+		    int i = (t + m + x) % k;
+		    if (!lost_flags[i])
+			gf_mul_add(coef(rows[a], x), &gathered[i * k * seg + x * seg], &syndrome[a * seg], seg);
+		}
+	    }
+	    // invert the u x u coefficient matrix by Gauss-Jordan elimination
+	    std::vector<unsigned char> A(u * u), inv(u * u, 0);
+	    for (unsigned int a = 0; a < u; a++) {
+		for (unsigned int b = 0; b < u; b++)
+		    A[a * u + b] = coef(rows[a], unknown[b]);
+		inv[a * u + a] = 1;
+	    }
+	    for (unsigned int c = 0; c < u; c++) {
+		unsigned int p = c;
+		while (A[p * u + c] == 0)
+		    p++;
+		for (unsigned int b = 0; b < u; b++) {
+		    std::swap(A[c * u + b], A[p * u + b]);
+		    std::swap(inv[c * u + b], inv[p * u + b]);
+		}
+		unsigned char f = gf_inv(A[c * u + c]);
+		for (unsigned int b = 0; b < u; b++) {
+		    A[c * u + b] = gf_mul(f, A[c * u + b]);
+		    inv[c * u + b] = gf_mul(f, inv[c * u + b]);
+		}
+		for (unsigned int a = 0; a < u; a++)
+		    if (a != c && A[a * u + c] != 0) {
+			unsigned char g = A[a * u + c];
+			for (unsigned int b = 0; b < u; b++) {
+			    A[a * u + b] ^= gf_mul(g, A[c * u + b]);
+			    inv[a * u + b] ^= gf_mul(g, inv[c * u + b]);
+			}
+		    }
+	    }
+	    unsigned int own = std::find(unknown.begin(), unknown.end(), s) - unknown.begin();
+	    memset(&result[0], 0, seg);
+	    for (unsigned int a = 0; a < u; a++)
+		gf_mul_add(inv[own * u + a], &syndrome[a * seg], &result[0], seg);
+	    ok = ok && pwrite(out_fd, &result[0], seg, r * rsize + s * seg) == (ssize_t)seg;
+	}
+    }
+    if (lost) {
+	ok = ok && ftruncate(out_fd, sizes[me]) == 0;
+	if (out_fd != -1)
+	    close(out_fd);
+	if (ok)
+	    INFO("rebuilt " << image_name << " (" << sizes[me] << " bytes) from the surviving group members");
+	else
+	    ERROR("cannot write the rebuilt " << image_name);
+    } else
+	close(image_fd);
+    if (fd != -1)
+	close(fd);
+    return ok;
+}
+
+std::string erasure_coder::get_stats() {
+    std::ostringstream ss;
+    ss << "ec_group = " << k << "+" << m << ", ec_parity = " << (stats_parity >> 10) << "KB";
+    return ss.str();
+}
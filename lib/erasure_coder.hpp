@@ -0,0 +1,68 @@
+/*******************************************************************************
+ Author: Bogdan Nicolae
+ Copyright (C) 2013 IBM Corp.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*******************************************************************************/
+
+#ifndef __ERASURE_CODER
+#define __ERASURE_CODER
+
+#include <string>
+#include <vector>
+
+#include <boost/mpi.hpp>
+
+// Group erasure coding of the checkpoint streams: each round takes k - m segments from every
+// member and produces k stripes; in stripe t the members (t + j) % k, j < m, hold parity row j
+// (XOR for m = 1, Cauchy Reed-Solomon over GF(2^8) otherwise) and the others contribute data.
+class erasure_coder {
+private:
+    boost::mpi::communicator group;
+    int k, m, me;
+    boost::uint64_t seg_size, round_size;
+
+    std::vector<char> data[2], send_buf[2], recv_buf[2];
+    MPI_Request reqs[2];
+    bool active[2];
+    unsigned int current;
+    boost::uint64_t fill, rounds, rounds_done, stream_size, parity_offset;
+    int parity_fd;
+    bool parity_ok;
+    boost::uint64_t stats_parity;
+
+    static unsigned char gf_exp[512], gf_log[256];
+    static void gf_init();
+    static unsigned char gf_mul(unsigned char a, unsigned char b);
+    static unsigned char gf_inv(unsigned char a);
+    static void gf_mul_add(unsigned char c, const char *src, char *dst, boost::uint64_t size);
+    unsigned char coef(int row, int column);
+    boost::uint64_t header_size();
+
+    void submit(unsigned int index);
+    void complete(unsigned int index);
+
+public:
+    erasure_coder(const boost::mpi::communicator &world, int k, int m, boost::uint64_t seg_size);
+    ~erasure_coder();
+
+    bool is_usable() { return k > m; }
+    void begin(const std::string &parity_name, boost::uint64_t max_size);
+    void push(const char *buff, boost::uint64_t size);
+    // false if the parity of this member could not be written
+    bool finish();
+    bool rebuild(const std::string &image_name, const std::string &parity_name);
+    std::string get_stats();
+};
+
+#endif
@@ -0,0 +1,85 @@
+/*******************************************************************************
+ Author: Bogdan Nicolae
+ Copyright (C) 2013 IBM Corp.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*******************************************************************************/
+
+#include "flush_governor.hpp"
+#include "ckpt_stats.hpp"
+
+#include <algorithm>
+
+flush_governor::flush_governor(boost::uint64_t ps, boost::uint64_t bandwidth, bool adapt_flag) :
+    page_size(ps), base_rate(bandwidth), rate(0), burst(0), adaptive(adapt_flag), tokens(0), last_refill(0),
+    window_start(0), window_faults(0), window_scheduled(0), window_wait(0), last_fault_rate(0) {
+    set_rate(bandwidth);
+}
+
+void flush_governor::set_rate(boost::uint64_t new_rate) {
+    // adaptive rates stay within [base / 4, base * 16]
+    rate = std::max(base_rate / 4, std::min(base_rate * 16, new_rate));
+    burst = std::max(rate / 100, BURST_PAGES * page_size);
+}
+
+void flush_governor::start_window(boost::uint64_t now) {
+    struct acfte_stats stats;
+    ckpt_stats::collect(&stats);
+    window_faults = 0;
+    for (unsigned int t = 0; t < ACFTE_FAULT_TYPES; t++)
+	window_faults += stats.faults[t];
+    window_scheduled = stats.faults[ACFTE_FAULT_WAIT] + stats.faults[ACFTE_FAULT_COW] + stats.faults[ACFTE_FAULT_SPILL];
+    window_wait = stats.faults[ACFTE_FAULT_WAIT];
+    window_start = now;
+}
+
+void flush_governor::begin() {
+    // the rate learned during the previous checkpoints is kept
+    last_refill = ckpt_stats::now_ns();
+    tokens = burst;
+    last_fault_rate = 0;
+    if (adaptive)
+	start_window(last_refill);
+}
+
+void flush_governor::adapt(boost::uint64_t now) {
+    boost::uint64_t faults = window_faults, scheduled = window_scheduled, wait = window_wait;
+    double elapsed = (now - window_start) / 1e9;
+
+    start_window(now);
+    faults = window_faults - faults;
+    scheduled = window_scheduled - scheduled;
+    wait = window_wait - wait;
+    double fault_rate = faults / elapsed;
+    if (wait > 0 || (scheduled > 0 && 2 * scheduled >= faults))
+	// threads block or copy on pages that are still pending
+	set_rate(rate * 3 / 2);
+    else if (last_fault_rate > 0 && fault_rate < last_fault_rate * 3 / 4)
+	set_rate(rate * 3 / 4);
+    last_fault_rate = fault_rate;
+}
+
+// consumes the tokens for bytes and returns 0, or returns how long to wait for them in us
+boost::uint64_t flush_governor::delay(boost::uint64_t bytes) {
+    boost::uint64_t now = ckpt_stats::now_ns();
+
+    if (adaptive && now - window_start >= ADAPT_WINDOW_NS)
+	adapt(now);
+    tokens = std::min((double)burst, tokens + (now - last_refill) * (double)rate / 1e9);
+    last_refill = now;
+    if (tokens >= bytes) {
+	tokens -= bytes;
+	return 0;
+    }
+    return (boost::uint64_t)((bytes - tokens) * 1e6 / rate) + 1;
+}
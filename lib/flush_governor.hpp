@@ -0,0 +1,52 @@
+/*******************************************************************************
+ Author: Bogdan Nicolae
+ Copyright (C) 2013 IBM Corp.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*******************************************************************************/
+
+#ifndef __FLUSH_GOVERNOR
+#define __FLUSH_GOVERNOR
+
+#include <boost/cstdint.hpp>
+
+// Token bucket pacing the bulk of the checkpoint flush, so the writer does not compete with
+// the application for the memory bus, the network and the file system. In adaptive mode the
+// rate follows the faults of the application: faults on pages still waiting to be flushed
+// mean that finishing sooner is cheaper, a falling fault rate means the application slows down.
+class flush_governor {
+private:
+    static const boost::uint64_t ADAPT_WINDOW_NS = 50000000;
+    static const unsigned int BURST_PAGES = 16;
+
+    boost::uint64_t page_size, base_rate, rate, burst;
+    bool adaptive;
+    double tokens;
+    boost::uint64_t last_refill;
+    // fault counters at the start of the current adaptation window
+    boost::uint64_t window_start, window_faults, window_scheduled, window_wait;
+    double last_fault_rate;
+
+    void set_rate(boost::uint64_t new_rate);
+    void adapt(boost::uint64_t now);
+    void start_window(boost::uint64_t now);
+
+public:
+    flush_governor(boost::uint64_t page_size, boost::uint64_t bandwidth, bool adaptive);
+
+    void begin();
+    boost::uint64_t delay(boost::uint64_t bytes);
+    boost::uint64_t get_rate() { return rate; }
+};
+
+#endif
@@ -0,0 +1,82 @@
+/*******************************************************************************
+ Author: Bogdan Nicolae
+ Copyright (C) 2013 IBM Corp.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*******************************************************************************/
+
+#include "flush_stagger.hpp"
+#include "ckpt_stats.hpp"
+
+#include <sstream>
+#include <algorithm>
+
+flush_stagger::flush_stagger(const boost::mpi::communicator &world, unsigned int w, double fsb) :
+    comm(world, boost::mpi::comm_duplicate), wave(w), fs_bandwidth(fsb), local_bandwidth(0),
+    waiting(false), sending(false), admit_start(0), admit_time(0), stats_wait_us(0) {
+    if (wave == 0)
+	wave = comm.size();
+}
+
+flush_stagger::~flush_stagger() {
+    if (sending)
+	handoff.wait();
+}
+
+// called by the writer of every rank as the checkpoint starts, before any page is written
+void flush_stagger::begin() {
+    if (sending) {
+	handoff.wait();
+	sending = false;
+    }
+    if (fs_bandwidth > 0) {
+	// every rank has to agree on the wave, the first checkpoint admits everyone
+	double fastest = boost::mpi::all_reduce(comm, local_bandwidth, boost::mpi::maximum<double>());
+	if (fastest > 0)
+	    wave = std::max(1, std::min(comm.size(), (int)(fs_bandwidth / fastest)));
+	else
+	    wave = comm.size();
+    }
+    admit_start = ckpt_stats::now_ns();
+    admit_time = 0;
+    waiting = comm.rank() >= (int)wave;
+    if (waiting)
+	token = comm.irecv(comm.rank() - wave, TOKEN_TAG);
+}
+
+bool flush_stagger::admitted() {
+    if (waiting && !token.test())
+	return false;
+    if (admit_time == 0) {
+	admit_time = ckpt_stats::now_ns();
+	stats_wait_us = (admit_time - admit_start) / 1000;
+    }
+    waiting = false;
+    return true;
+}
+
+void flush_stagger::finish(boost::uint64_t bytes) {
+    if (comm.rank() + wave < (unsigned int)comm.size()) {
+	handoff = comm.isend(comm.rank() + wave, TOKEN_TAG);
+	sending = true;
+    }
+    boost::uint64_t elapsed = ckpt_stats::now_ns() - admit_time;
+    if (bytes > 0 && elapsed > 0)
+	local_bandwidth = bytes * 1e9 / elapsed;
+}
+
+std::string flush_stagger::get_stats() {
+    std::ostringstream ss;
+    ss << "flush_wave = " << wave << ", admission_wait = " << stats_wait_us << "us";
+    return ss.str();
+}
@@ -0,0 +1,50 @@
+/*******************************************************************************
+ Author: Bogdan Nicolae
+ Copyright (C) 2013 IBM Corp.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*******************************************************************************/
+
+#ifndef __FLUSH_STAGGER
+#define __FLUSH_STAGGER
+
+#include <string>
+
+#include <boost/mpi.hpp>
+
+// Admits the ranks to the file system in waves of `wave` ranks: rank r flushes once rank
+// r - wave has passed it the token, then hands it on to r + wave. The wave is either fixed or
+// derived at every checkpoint from the aggregate bandwidth of the file system and the fastest
+// per-rank flush bandwidth measured so far. Every rank has to take part in every checkpoint.
+class flush_stagger {
+private:
+    static const int TOKEN_TAG = 1;
+
+    boost::mpi::communicator comm;
+    unsigned int wave;
+    double fs_bandwidth, local_bandwidth;
+    boost::mpi::request token, handoff;
+    bool waiting, sending;
+    boost::uint64_t admit_start, admit_time, stats_wait_us;
+
+public:
+    flush_stagger(const boost::mpi::communicator &world, unsigned int wave, double fs_bandwidth);
+    ~flush_stagger();
+
+    void begin();
+    bool admitted();
+    void finish(boost::uint64_t bytes);
+    std::string get_stats();
+};
+
+#endif
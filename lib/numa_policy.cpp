@@ -0,0 +1,97 @@
+/*******************************************************************************
+ Author: Bogdan Nicolae
+ Copyright (C) 2013 IBM Corp.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*******************************************************************************/
+
+#include "numa_policy.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+extern "C" {
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+}
+
+#define MAX_NODE_LIST 4096
+
+// parses a sysfs list like "0-3,8,10-11", calling set for every member
+template <class F> static bool parse_list(const char *file_name, F set) {
+    char list[MAX_NODE_LIST], *pos;
+    FILE *f = fopen(file_name, "r");
+    if (f == NULL)
+	return false;
+    bool ok = fgets(list, MAX_NODE_LIST, f) != NULL;
+    fclose(f);
+    if (!ok)
+	return false;
+    for (char *range = strtok_r(list, ",\n", &pos); range != NULL; range = strtok_r(NULL, ",\n", &pos)) {
+	unsigned int first, last;
+	int n = sscanf(range, "%u-%u", &first, &last);
+	if (n < 1)
+	    return false;
+	if (n == 1)
+	    last = first;
+	for (unsigned int i = first; i <= last; i++)
+	    set(i);
+    }
+    return true;
+}
+
+unsigned int numa_policy::nodes() {
+    static unsigned int count = 0;
+
+    if (count == 0) {
+	unsigned int highest = 0;
+	if (!parse_list("/sys/devices/system/node/online", [&](unsigned int n) { highest = std::max(highest, n); }))
+	    highest = 0;
+	count = std::min(highest + 1, MAX_NODES);
+    }
+    return count;
+}
+
+// node holding the page at addr, -1 if unknown; a single system call, safe in the fault handler
+int numa_policy::node_of(const void *addr) {
+    int node;
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr, MPOL_F_NODE | MPOL_F_ADDR) == -1)
+	return -1;
+    return node;
+}
+
+// batched lookup: status receives the node of every page, or a negative errno
+void numa_policy::nodes_of(char **addrs, size_t count, int *status) {
+    if (syscall(SYS_move_pages, 0, count, addrs, NULL, status, 0) == -1)
+	for (size_t i = 0; i < count; i++)
+	    status[i] = -1;
+}
+
+bool numa_policy::prefer(void *addr, size_t size, unsigned int node) {
+    unsigned long mask = 1UL << node;
+    return syscall(SYS_mbind, addr, size, MPOL_PREFERRED, &mask, MAX_NODES, MPOL_MF_MOVE) == 0;
+}
+
+bool numa_policy::pin_thread(unsigned int node) {
+    char file_name[128];
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    sprintf(file_name, "/sys/devices/system/node/node%u/cpulist", node);
+    if (!parse_list(file_name, [&](unsigned int cpu) { if (cpu < CPU_SETSIZE) CPU_SET(cpu, &cpus); }))
+	return false;
+    return sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+}
@@ -0,0 +1,35 @@
+/*******************************************************************************
+ Author: Bogdan Nicolae
+ Copyright (C) 2013 IBM Corp.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*******************************************************************************/
+
+#ifndef __NUMA_POLICY
+#define __NUMA_POLICY
+
+#include <cstddef>
+
+// NUMA placement through the raw system calls, so there is no dependency on libnuma.
+// Without NUMA support everything behaves as a single node.
+struct numa_policy {
+    static const unsigned int MAX_NODES = 64;
+
+    static unsigned int nodes();
+    static int node_of(const void *addr);
+    static void nodes_of(char **addrs, size_t count, int *status);
+    static bool prefer(void *addr, size_t size, unsigned int node);
+    static bool pin_thread(unsigned int node);
+};
+
+#endif
@@ -0,0 +1,270 @@
+/*******************************************************************************
+ Author: Bogdan Nicolae
+ Copyright (C) 2013 IBM Corp.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*******************************************************************************/
+
+#include "partner_replicator.hpp"
+
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+
+#include <boost/thread.hpp>
+
+extern "C" {
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+}
+
+//#define __DEBUG
+#include "common/debug.hpp"
+
+partner_replicator::partner_replicator(const boost::mpi::communicator &world, const std::string &sp,
+				       boost::uint64_t cs, boost::uint64_t ml, bool kh) :
+    comm(world, boost::mpi::comm_duplicate), store_prefix(sp), chunk_size(cs), mem_limit(ml),
+    mem_used(0), keep_history(kh), send_bufs(SEND_BUFFERS, std::vector<char>(cs)),
+    send_reqs(SEND_BUFFERS), current_buf(0), current_fill(0), recv_buf(cs), seq_no(-1),
+    recv_ack(-1), sent_ack(-1), recv_done(true), ack_done(true), stats_sent(0), stats_received(0) {
+    MPI_Comm node;
+    int leader = comm.rank();
+
+    // every rank learns the node of every other one, named after the lowest rank it hosts
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, comm.rank(), MPI_INFO_NULL, &node);
+    boost::mpi::communicator node_comm(node, boost::mpi::comm_take_ownership);
+    boost::mpi::broadcast(node_comm, leader, 0);
+    std::vector<int> nodes;
+    boost::mpi::all_gather(comm, leader, nodes);
+
+    // in node-major order, one largest node further is always another node unless a single
+    // node holds more than half of the ranks
+    std::vector<std::pair<int, int> > order;
+    std::map<int, int> node_size;
+    int shift = 0, pos = 0;
+    for (int r = 0; r < comm.size(); r++) {
+	order.push_back(std::make_pair(nodes[r], r));
+	shift = std::max(shift, ++node_size[nodes[r]]);
+    }
+    std::sort(order.begin(), order.end());
+    while (order[pos].second != comm.rank())
+	pos++;
+    if (shift >= comm.size()) {
+	ERROR("all ranks share the same node, partner copies will not survive a node failure");
+	shift = 1;
+    }
+    buddy = order[(pos + shift) % comm.size()].second;
+    source = order[(pos - shift + comm.size()) % comm.size()].second;
+    if (nodes[buddy] == leader)
+	ERROR("rank " << comm.rank() << " shares its node with its buddy " << buddy
+	      << ", its partner copy will not survive a node failure");
+}
+
+partner_replicator::~partner_replicator() {
+    for (replica_map_t::iterator r = replicas.begin(); r != replicas.end(); r++)
+	if (r->second.fd != -1)
+	    close(r->second.fd);
+}
+
+bool partner_replicator::store(int seq, const char *buff, boost::uint64_t size) {
+    replica_t &r = replicas[seq];
+
+    if (!r.good)
+	return false;
+    if (r.fd == -1 && mem_used + size <= mem_limit) {
+	r.data.insert(r.data.end(), buff, buff + size);
+	mem_used += size;
+    } else {
+	// over the memory budget: move the replica to the local disk buffer
+	if (r.fd == -1) {
+	    std::ostringstream ss;
+	    ss << store_prefix << "/blobcr-partner-" << source << "-" << seq << ".dat";
+	    r.file_name = ss.str();
+	    r.fd = open(r.file_name.c_str(), O_RDWR | O_TRUNC | O_CREAT, 0666);
+	    ssize_t ret = r.fd == -1 ? -1 : write(r.fd, &r.data[0], r.data.size());
+	    mem_used -= r.data.size();
+	    std::vector<char>().swap(r.data);
+	    if (ret != (ssize_t)r.size) {
+		ERROR("cannot spill the partner copy of rank " << source << " to " << r.file_name);
+		r.good = false;
+		return false;
+	    }
+	}
+	if (write(r.fd, buff, size) != (ssize_t)size) {
+	    ERROR("cannot write the partner copy of rank " << source << " to " << r.file_name);
+	    r.good = false;
+	    return false;
+	}
+    }
+    r.size += size;
+    return true;
+}
+
+void partner_replicator::post_send(unsigned int index, boost::uint64_t size) {
+    send_reqs[index] = comm.isend(buddy, TAG_DATA, &send_bufs[index][0], size);
+    stats_sent += size;
+}
+
+void partner_replicator::progress() {
+    for (unsigned int i = 0; i < SEND_BUFFERS; i++)
+	if (send_reqs[i] && send_reqs[i]->test())
+	    send_reqs[i] = boost::none;
+    if (recv_req) {
+	boost::optional<boost::mpi::status> st = recv_req->test();
+	if (st) {
+	    int count = *st->count<char>();
+	    recv_req = boost::none;
+	    if (count == 0) {
+		// end of stream, the partner copy of source is complete
+		recv_done = true;
+		sent_ack = replicas[seq_no].good ? seq_no : -1;
+		ack_send_req = comm.isend(source, TAG_ACK, sent_ack);
+		if (!keep_history)
+		    while (replicas.begin()->first != seq_no) {
+			replica_t &r = replicas.begin()->second;
+			if (r.fd != -1) {
+			    close(r.fd);
+			    unlink(r.file_name.c_str());
+			}
+			mem_used -= r.data.size();
+			replicas.erase(replicas.begin());
+		    }
+	    } else {
+		store(seq_no, &recv_buf[0], count);
+		stats_received += count;
+		recv_req = comm.irecv(source, TAG_DATA, &recv_buf[0], chunk_size);
+	    }
+	}
+    }
+    if (ack_send_req && ack_send_req->test())
+	ack_send_req = boost::none;
+    if (ack_req && ack_req->test()) {
+	ack_req = boost::none;
+	ack_done = true;
+    }
+}
+
+void partner_replicator::begin(int seq) {
+    seq_no = seq;
+    current_buf = 0;
+    current_fill = 0;
+    recv_done = ack_done = false;
+    replicas[seq_no] = replica_t();
+    recv_req = comm.irecv(source, TAG_DATA, &recv_buf[0], chunk_size);
+    ack_req = comm.irecv(buddy, TAG_ACK, recv_ack);
+}
+
+void partner_replicator::push(const char *buff, boost::uint64_t size) {
+    while (size > 0) {
+	boost::uint64_t len = std::min(size, chunk_size - current_fill);
+	memcpy(&send_bufs[current_buf][current_fill], buff, len);
+	current_fill += len;
+	buff += len;
+	size -= len;
+	if (current_fill == chunk_size) {
+	    post_send(current_buf, current_fill);
+	    current_buf = (current_buf + 1) % SEND_BUFFERS;
+	    current_fill = 0;
+	    while (send_reqs[current_buf]) {
+		progress();
+		boost::this_thread::yield();
+	    }
+	}
+    }
+    progress();
+}
+
+bool partner_replicator::finish() {
+    if (current_fill > 0) {
+	post_send(current_buf, current_fill);
+	current_buf = (current_buf + 1) % SEND_BUFFERS;
+	current_fill = 0;
+	while (send_reqs[current_buf]) {
+	    progress();
+	    boost::this_thread::yield();
+	}
+    }
+    // an empty message marks the end of the stream
+    send_reqs[current_buf] = comm.isend(buddy, TAG_DATA, &send_bufs[current_buf][0], 0);
+    while (1) {
+	progress();
+	bool sends_done = true;
+	for (unsigned int i = 0; i < SEND_BUFFERS; i++)
+	    if (send_reqs[i])
+		sends_done = false;
+	if (sends_done && recv_done && ack_done && !ack_send_req)
+	    break;
+	boost::this_thread::yield();
+    }
+    // the buddy acknowledges with -1 when it could not keep the copy
+    return recv_ack == seq_no;
+}
+
+bool partner_replicator::restore(int seq, const std::string &file_name) {
+    replica_map_t::iterator r = replicas.find(seq);
+    long long size = -1, own_size;
+    const char *data = NULL;
+    bool mapped = false, ok = true;
+    std::vector<boost::mpi::request> reqs;
+
+    // hand the copy we keep back to its owner, while receiving ours from the buddy
+    if (r != replicas.end() && r->second.good) {
+	size = r->second.size;
+	if (r->second.fd == -1 && size > 0)
+	    data = &r->second.data[0];
+	else if (size > 0) {
+	    data = (const char *)mmap(NULL, size, PROT_READ, MAP_SHARED, r->second.fd, 0);
+	    mapped = data != MAP_FAILED;
+	    if (!mapped) {
+		ERROR("cannot map the partner copy of rank " << source << " from " << r->second.file_name);
+		size = -1;
+	    }
+	}
+    }
+    reqs.push_back(comm.isend(source, TAG_RESTORE, size));
+    for (long long offset = 0; offset < size; offset += chunk_size)
+	reqs.push_back(comm.isend(source, TAG_RESTORE, data + offset,
+				  std::min((long long)chunk_size, size - offset)));
+
+    comm.recv(buddy, TAG_RESTORE, own_size);
+    int fd = -1;
+    if (own_size >= 0) {
+	fd = open(file_name.c_str(), O_WRONLY | O_TRUNC | O_CREAT, 0666);
+	ok = fd != -1;
+    }
+    // the whole stream is received even after an error, the buddy is still sending it
+    for (long long offset = 0; offset < own_size; offset += chunk_size) {
+	boost::mpi::status st = comm.recv(buddy, TAG_RESTORE, &recv_buf[0], chunk_size);
+	ssize_t count = *st.count<char>();
+	ok = ok && write(fd, &recv_buf[0], count) == count;
+    }
+    if (fd != -1)
+	close(fd);
+    if (own_size >= 0 && !ok)
+	ERROR("cannot restore the partner copy of rank " << comm.rank() << " into " << file_name);
+
+    boost::mpi::wait_all(reqs.begin(), reqs.end());
+    if (mapped)
+	munmap((void *)data, size);
+    return own_size >= 0 && ok;
+}
+
+std::string partner_replicator::get_stats() {
+    std::ostringstream ss;
+    ss << "buddy = " << buddy << ", partner_sent = " << (stats_sent >> 20) << "MB"
+       << ", partner_received = " << (stats_received >> 20) << "MB"
+       << ", partner_mem = " << (mem_used >> 20) << "MB";
+    return ss.str();
+}
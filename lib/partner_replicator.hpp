@@ -0,0 +1,84 @@
+/*******************************************************************************
+ Author: Bogdan Nicolae
+ Copyright (C) 2013 IBM Corp.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*******************************************************************************/
+
+#ifndef __PARTNER_REPLICATOR
+#define __PARTNER_REPLICATOR
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <boost/mpi.hpp>
+#include <boost/optional.hpp>
+
+// Streams the checkpoint of this rank to a buddy rank on another node while
+// keeping the stream of the rank that chose us as buddy in a bounded buffer
+class partner_replicator {
+private:
+    static const int TAG_DATA = 1, TAG_ACK = 2, TAG_RESTORE = 3;
+    static const unsigned int SEND_BUFFERS = 4;
+
+    struct replica_t {
+	std::vector<char> data;
+	std::string file_name;
+	int fd;
+	boost::uint64_t size;
+	// false once a part of the stream could not be stored
+	bool good;
+	replica_t() : fd(-1), size(0), good(true) { }
+    };
+    typedef std::map<int, replica_t> replica_map_t;
+
+    // private copy of the world communicator, so the streams never match application messages
+    boost::mpi::communicator comm;
+    int buddy, source;
+    std::string store_prefix;
+    boost::uint64_t chunk_size, mem_limit, mem_used;
+    bool keep_history;
+
+    std::vector<std::vector<char> > send_bufs;
+    std::vector<boost::optional<boost::mpi::request> > send_reqs;
+    unsigned int current_buf;
+    boost::uint64_t current_fill;
+
+    std::vector<char> recv_buf;
+    boost::optional<boost::mpi::request> recv_req, ack_req, ack_send_req;
+    int seq_no, recv_ack, sent_ack;
+    bool recv_done, ack_done;
+    boost::uint64_t stats_sent, stats_received;
+
+    replica_map_t replicas;
+
+    void post_send(unsigned int index, boost::uint64_t size);
+    bool store(int seq, const char *buff, boost::uint64_t size);
+    void progress();
+
+public:
+    partner_replicator(const boost::mpi::communicator &world, const std::string &store_prefix,
+		       boost::uint64_t chunk_size, boost::uint64_t mem_limit, bool keep_history);
+    ~partner_replicator();
+
+    int get_buddy() { return buddy; }
+    void begin(int seq_no);
+    void push(const char *buff, boost::uint64_t size);
+    // true if the buddy holds a complete copy
+    bool finish();
+    bool restore(int seq_no, const std::string &file_name);
+    std::string get_stats();
+};
+
+#endif
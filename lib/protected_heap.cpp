@@ -0,0 +1,192 @@
+/*******************************************************************************
+ Author: Bogdan Nicolae
+ Copyright (C) 2013 IBM Corp.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*******************************************************************************/
+
+#include "protected_heap.hpp"
+
+extern "C" {
+#include <sys/mman.h>
+}
+
+//#define __DEBUG
+#include "common/debug.hpp"
+
+const unsigned char protected_heap::NO_CLASS;
+
+protected_heap::protected_heap(region_manager *m, size_t ps, size_t as) :
+    manager(m), page_size(ps), arena_size(as), no_classes(0) {
+    // classes up to half a page, larger requests get whole pages
+    while (((size_t)1 << (MIN_CLASS_SHIFT + no_classes)) <= page_size / 2)
+	no_classes++;
+    free_lists.resize(no_classes, NULL);
+    if (arena_size < SLAB_PAGES * page_size)
+	arena_size = SLAB_PAGES * page_size;
+}
+
+protected_heap::~protected_heap() {
+    for (unsigned int i = 0; i < arenas.size(); i++) {
+	if (arenas[i].used > 0)
+	    manager->remove_region(arenas[i].base, arenas[i].used);
+	munmap(arenas[i].base, arena_size);
+    }
+    for (std::map<char *, size_t>::iterator l_it = large.begin(); l_it != large.end(); l_it++) {
+	manager->remove_region(l_it->first, l_it->second);
+	munmap(l_it->first, l_it->second);
+    }
+}
+
+char *protected_heap::carve(size_t pages, unsigned char size_class) {
+    size_t size = pages * page_size;
+    if (arenas.empty() || arenas.back().used + size > arena_size) {
+	// reserve address space only, pages are tracked once handed out
+	arena_t arena;
+	arena.base = (char *)mmap(NULL, arena_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (arena.base == MAP_FAILED)
+	    return NULL;
+	arena.used = 0;
+	arena.page_class.resize(arena_size / page_size, NO_CLASS);
+	arenas.push_back(arena);
+    }
+    arena_t &arena = arenas.back();
+    char *result = arena.base + arena.used;
+    for (size_t i = 0; i < pages; i++)
+	arena.page_class[arena.used / page_size + i] = size_class;
+    arena.used += size;
+    manager->add_region(result, size);
+    return result;
+}
+
+protected_heap::arena_t *protected_heap::find_arena(char *ptr) {
+    for (unsigned int i = 0; i < arenas.size(); i++)
+	if (ptr >= arenas[i].base && ptr < arenas[i].base + arenas[i].used)
+	    return &arenas[i];
+    return NULL;
+}
+
+void protected_heap::remove_free_run(std::map<char *, size_t>::iterator a_it) {
+    std::pair<std::multimap<size_t, char *>::iterator, std::multimap<size_t, char *>::iterator> range =
+	free_runs.equal_range(a_it->second);
+    for (std::multimap<size_t, char *>::iterator f_it = range.first; f_it != range.second; f_it++)
+	if (f_it->second == a_it->first) {
+	    free_runs.erase(f_it);
+	    break;
+	}
+    free_by_addr.erase(a_it);
+}
+
+// runs only merge within their arena, the next arena may be mapped right after it
+void protected_heap::add_free_run(arena_t *arena, char *run, size_t pages) {
+    std::map<char *, size_t>::iterator n_it = free_by_addr.lower_bound(run);
+    if (n_it != free_by_addr.begin()) {
+	std::map<char *, size_t>::iterator p_it = n_it;
+	p_it--;
+	if (p_it->first >= arena->base && p_it->first + p_it->second * page_size == run) {
+	    run = p_it->first;
+	    pages += p_it->second;
+	    remove_free_run(p_it);
+	}
+    }
+    if (n_it != free_by_addr.end() && n_it->first == run + pages * page_size &&
+	n_it->first < arena->base + arena->used) {
+	pages += n_it->second;
+	remove_free_run(n_it);
+    }
+    free_by_addr[run] = pages;
+    free_runs.insert(std::make_pair(pages, run));
+}
+
+void *protected_heap::malloc(size_t size) {
+    boost::mutex::scoped_lock lock(heap_lock);
+    unsigned int c = 0;
+
+    if (size == 0)
+	size = 1;
+    while (c < no_classes && ((size_t)1 << (MIN_CLASS_SHIFT + c)) < size)
+	c++;
+    if (c == no_classes) {
+	size_t pages = (size + page_size - 1) / page_size;
+	char *run;
+	if (pages * page_size > arena_size) {
+	    // too large for any arena: a mapping of its own, tracked as a whole
+	    run = (char *)mmap(NULL, pages * page_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	    if (run == MAP_FAILED)
+		return NULL;
+	    manager->add_region(run, pages * page_size);
+	    large[run] = pages * page_size;
+	    return run;
+	}
+	std::multimap<size_t, char *>::iterator f_it = free_runs.lower_bound(pages);
+	if (f_it != free_runs.end()) {
+	    // best fit, the tail goes back to the free runs
+	    run = f_it->second;
+	    size_t found = f_it->first;
+	    remove_free_run(free_by_addr.find(run));
+	    if (found > pages) {
+		free_by_addr[run + pages * page_size] = found - pages;
+		free_runs.insert(std::make_pair(found - pages, run + pages * page_size));
+	    }
+	} else if ((run = carve(pages, NO_CLASS)) == NULL)
+	    return NULL;
+	runs[run] = pages;
+	return run;
+    }
+    if (free_lists[c] == NULL) {
+	size_t obj_size = (size_t)1 << (MIN_CLASS_SHIFT + c);
+	char *slab = carve(SLAB_PAGES, c);
+	if (slab == NULL)
+	    return NULL;
+	// chain back to front so that objects are handed out in address order
+	for (size_t i = SLAB_PAGES * page_size / obj_size; i-- > 0; ) {
+	    *(char **)(slab + i * obj_size) = free_lists[c];
+	    free_lists[c] = slab + i * obj_size;
+	}
+    }
+    char *result = free_lists[c];
+    free_lists[c] = *(char **)result;
+    return result;
+}
+
+bool protected_heap::free(void *ptr) {
+    boost::mutex::scoped_lock lock(heap_lock);
+    char *obj = (char *)ptr;
+
+    if (obj == NULL)
+	return true;
+    std::map<char *, size_t>::iterator l_it = large.find(obj);
+    if (l_it != large.end()) {
+	manager->remove_region(l_it->first, l_it->second);
+	munmap(l_it->first, l_it->second);
+	large.erase(l_it);
+	return true;
+    }
+    arena_t *arena = find_arena(obj);
+    if (arena == NULL)
+	return false;
+    unsigned char c = arena->page_class[(obj - arena->base) / page_size];
+    if (c != NO_CLASS) {
+	*(char **)obj = free_lists[c];
+	free_lists[c] = obj;
+	return true;
+    }
+    std::map<char *, size_t>::iterator r_it = runs.find(obj);
+    if (r_it == runs.end()) {
+	ERROR("pfree() called on " << ptr << ", which is not the start of an allocation");
+	return true;
+    }
+    add_free_run(arena, r_it->first, r_it->second);
+    runs.erase(r_it);
+    return true;
+}
@@ -0,0 +1,71 @@
+/*******************************************************************************
+ Author: Bogdan Nicolae
+ Copyright (C) 2013 IBM Corp.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*******************************************************************************/
+
+#ifndef __PROTECTED_HEAP
+#define __PROTECTED_HEAP
+
+#include <vector>
+#include <map>
+
+#include <boost/thread/mutex.hpp>
+
+#include "region_manager.hpp"
+
+// Small-object heap for pmalloc()/pfree(): size-class slabs and page runs carved from large
+// arenas, registered with the region manager slab by slab as they come into use. Freed small
+// objects are chained through their own first bytes; everything else is kept out of band.
+// Requests larger than an arena get a mapping of their own.
+class protected_heap {
+private:
+    static const unsigned int MIN_CLASS_SHIFT = 4, SLAB_PAGES = 16;
+    static const unsigned char NO_CLASS = 0xff;
+
+    struct arena_t {
+	char *base;
+	size_t used;
+	// size class of every carved page, NO_CLASS for page runs
+	std::vector<unsigned char> page_class;
+    };
+
+    region_manager *manager;
+    size_t page_size, arena_size;
+    unsigned int no_classes;
+    std::vector<arena_t> arenas;
+    std::vector<char *> free_lists;
+    // page runs: size of the live ones, free ones by number of pages and by address, the latter
+    // to merge a freed run with its free neighbours
+    std::map<char *, size_t> runs, free_by_addr;
+    std::multimap<size_t, char *> free_runs;
+    // allocations larger than an arena and the size of their mapping
+    std::map<char *, size_t> large;
+    boost::mutex heap_lock;
+
+    char *carve(size_t pages, unsigned char size_class);
+    arena_t *find_arena(char *ptr);
+    void add_free_run(arena_t *arena, char *run, size_t pages);
+    void remove_free_run(std::map<char *, size_t>::iterator a_it);
+
+public:
+    protected_heap(region_manager *manager, size_t page_size, size_t arena_size);
+    ~protected_heap();
+
+    void *malloc(size_t size);
+    // false if ptr does not come from this heap
+    bool free(void *ptr);
+};
+
+#endif
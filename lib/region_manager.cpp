@@ -18,29 +18,133 @@
 #include "region_manager.hpp"
 
 #include <cstdlib>
+#include <cstring>
 #include <algorithm>
+#include <map>
+
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/utility.hpp>
+#include <boost/serialization/vector.hpp>
 
 extern "C" {
 #include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 }
 
 #define __DEBUG
 #include "common/debug.hpp"
 
 #define NO_RECLAIM_SIZE (1 << 29)
+#define TOUCHED_LOG_SIZE (1 << 16)
+
+// index of the touched log of the calling thread, shared by all region managers: a thread
+// claims the lowest free slot at its first logged write, collect_touched() gives it back
+// once the thread is gone
+static std::atomic<boost::uint64_t> touched_log_busy(0);
+// thread id of each owner, one per bit of touched_log_busy
+static std::atomic<pid_t> touched_log_owner[64];
+static __thread int touched_log_slot = -1;
+
+// called from the fault handler: only atomics and a system call, no thread-specific data
+static int claim_touched_log() {
+    boost::uint64_t busy = touched_log_busy.load(std::memory_order_relaxed);
+    while (~busy != 0) {
+	int slot = __builtin_ctzll(~busy);
+	if (touched_log_busy.compare_exchange_weak(busy, busy | ((boost::uint64_t)1 << slot))) {
+	    touched_log_owner[slot].store(syscall(SYS_gettid), std::memory_order_release);
+	    return slot;
+	}
+    }
+    return -1;
+}
+
+// the exited owner of a slot, or 0: its thread id may not be known yet right after the claim
+static pid_t touched_log_orphan(unsigned int slot) {
+    if (!(touched_log_busy.load(std::memory_order_relaxed) & ((boost::uint64_t)1 << slot)))
+	return 0;
+    pid_t owner = touched_log_owner[slot].load(std::memory_order_acquire);
+    if (owner != 0 && syscall(SYS_tgkill, getpid(), owner, 0) == -1 && errno == ESRCH)
+	return owner;
+    return 0;
+}
+
+// recent fault streams of the calling thread, e.g. one per array of a streaming kernel: a fault
+// continues the stream expecting it closest, a stride seen STREAM_CONFIRM times in a row confirms it
+struct fault_stream_t {
+    const void *owner;
+    char *last, *next;
+    long stride;
+    unsigned int repeats, window;
+    boost::uint64_t used;
+};
+static const unsigned int FAULT_STREAMS = 4, STREAM_CONFIRM = 2, MAX_STREAM_STRIDE = 16;
+// bounds the pages a fault handles ahead, they are collected on the handler's stack
+static const unsigned int MAX_SPECULATE_WINDOW = 256;
+static __thread fault_stream_t fault_streams[FAULT_STREAMS];
+
+const float region_manager::ORDER_HINT_WEIGHT = 0.5;
+
+static boost::mutex mpi_env_lock;
+static boost::mpi::environment *mpi_env_shared = NULL;
+static unsigned int mpi_env_users = 0;
+
+region_manager::mpi_env_ref_t::mpi_env_ref_t() {
+    boost::mutex::scoped_lock lock(mpi_env_lock);
+    if (mpi_env_users++ == 0)
+	mpi_env_shared = new boost::mpi::environment(boost::mpi::threading::multiple);
+}
+
+// runs after the communicators of the manager are freed
+region_manager::mpi_env_ref_t::~mpi_env_ref_t() {
+    boost::mutex::scoped_lock lock(mpi_env_lock);
+    if (--mpi_env_users == 0) {
+	delete mpi_env_shared;
+	mpi_env_shared = NULL;
+    }
+}
 
 region_manager::region_manager(boost::uint64_t ps, std::string &cp, std::string &cl,
 			       boost::uint64_t extra_mem, bool iflag, 
-			       bool aflag, bool dflag, bool gdflag) :
-    page_size(ps), ckpt_path_prefix(cp), cow_threshold(extra_mem / page_size),
-    incremental_flag(iflag), access_order_flag(aflag), dedup_flag(dflag),
-    global_dedup_flag(gdflag), total_mem_size(0), no_blocks(0), seq_no(0),
-    stats_page_cow(0), stats_page_wait(0), stats_page_after(0), stats_page_delayed(0),
-    checkpoint_in_progress(false), async_io_thread(boost::bind(&region_manager::async_io_exec, this))  {    
+			       bool aflag, bool lflag, bool dflag, bool gdflag) :
+    page_size(ps), ckpt_path_prefix(cp), cow_threshold(extra_mem / page_size), spill_threshold(0),
+    incremental_flag(iflag), access_order_flag(aflag), learned_order_flag(lflag), dedup_flag(dflag),
+    global_dedup_flag(gdflag), dedup_report_flag(false),
+    dedup_pipelined(false), flush_position(0), fingerprint_cache_flag(dflag && !iflag), fork_flag(false), snapshot_pid(0),
+    urgent_head(0), urgent_tail(0), urgent_window(0),
+    speculate_window(0), total_mem_size(0),
+    regions(new region_set_t()), region_readers(0), no_blocks(0), no_scheduled(0), seq_no(0),
+    stats_page_cow(0), stats_page_spill(0), stats_page_wait(0), stats_page_after(0), stats_page_delayed(0),
+    stats_order_faults(0), stats_addr_order_faults(0), stats_urgent(0), stats_max_wait_us(0),
+    checkpoint_in_progress(false), ckpt_callback(NULL), ckpt_callback_arg(NULL), async_io_thread(boost::bind(&region_manager::async_io_exec, this)),
+    numa_nodes(1), node_epoch(0), node_busy(0), node_fd(-1), flush_offset(0),
+    scheduler(NULL),
+    mpi_comm_world(boost::mpi::communicator(), boost::mpi::comm_duplicate) {
+
     no_reclaim_allocator::init(NO_RECLAIM_SIZE);
     simple_sweep_allocator::init(page_size, extra_mem);
-    dup_engine = new dedup_engine(&mpi_comm_world);
+    ckpt_stats::set_capacity(ckpt_stats::COW_PAGES, cow_threshold);
+    dup_engine = new dedup_engine(mpi_comm_world);
+    fingerprint_buffer.resize(page_size);
+    dup_engine->set_fingerprint_cache(fingerprint_cache_flag);
+    drainer = NULL;
+    partner = NULL;
+    coder = NULL;
+    shared = NULL;
+    governor = NULL;
+    stagger = NULL;
+    trace = NULL;
+    touched_log_region = NULL;
+    touched_overflow_size = 0;
+    touched_lost = false;
+    touched_overflow_lock.clear();
+    set_touched_log_size(TOUCHED_LOG_SIZE);
+    if (global_dedup_flag && boost::mpi::environment::thread_level() != boost::mpi::threading::multiple)
+	ERROR("without MPI_THREAD_MULTIPLE, pages deduplicated against other ranks cannot be located on restore");
     if (cl != "") {
 	std::ostringstream ss;
 	ss << cl << "/ckpt_messages-rank_" << mpi_comm_world.rank() << ".log";
@@ -55,17 +159,348 @@ region_manager::region_manager(boost::uint64_t ps, std::string &cp, std::string
 }
 
 region_manager::~region_manager() {
+    // I/O on other threads may still be prefaulting: leave it nothing to walk and let it finish
+    region_set_t *last = regions.exchange(new region_set_t());
+    while (region_readers.load() != 0)
+	boost::this_thread::yield();
+    delete last;
     async_io_thread.interrupt();
     async_io_thread.join(); 
+    node_writers.interrupt_all();
+    node_writers.join_all();
+    delete scheduler;
 
     while (pages.size() > 0) {
 	page_map_t::iterator p_it = pages.begin();
 	mprotect(p_it->first, page_size, PROT_READ | PROT_WRITE);
 	pages.erase(p_it);
     }
+    delete regions.load();
+    for (unsigned int i = 0; i < retired_regions.size(); i++)
+	delete retired_regions[i];
     delete dup_engine;
+    delete drainer;
+    delete partner;
+    delete coder;
+    delete shared;
+    delete governor;
+    delete stagger;
+    delete trace;
+    // release everything that lives in the no-reclaim region before unmapping it
+    page_map_t().swap(pages);
+    touched_t().swap(touched);
+    touched_t().swap(new_touched);
     no_reclaim_allocator::destroy();
     simple_sweep_allocator::destroy();
+    if (spill_threshold > 0)
+	spill_allocator::destroy();
+    munmap(touched_log_region, (MAX_TOUCHED_LOGS + 1) * touched_log_capacity * sizeof(touched_log_entry_t));
+}
+
+void region_manager::set_touched_log_size(unsigned long entries) {
+    boost::mutex::scoped_lock lock(page_lock);
+    // only before anything was tracked: faults append without taking the lock
+    if (!pages.empty())
+	return;
+    if (touched_log_region != NULL)
+	munmap(touched_log_region, (MAX_TOUCHED_LOGS + 1) * touched_log_capacity * sizeof(touched_log_entry_t));
+    touched_log_capacity = entries;
+    // address space only, a ring is backed as its thread fills it; the overflow area comes last
+    touched_log_region = (touched_log_entry_t *)mmap(NULL, (MAX_TOUCHED_LOGS + 1) * entries * sizeof(touched_log_entry_t),
+						     PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    ASSERT(touched_log_region != MAP_FAILED);
+    for (unsigned int i = 0; i < MAX_TOUCHED_LOGS; i++) {
+	touched_logs[i].entries = touched_log_region + i * entries;
+	touched_logs[i].head = touched_logs[i].tail = 0;
+    }
+    touched_overflow = touched_log_region + MAX_TOUCHED_LOGS * entries;
+    touched_overflow_size = 0;
+}
+
+void region_manager::log_touched(char *addr, char access_type, boost::uint64_t stamp) {
+    if (touched_log_slot < 0)
+	touched_log_slot = claim_touched_log();
+    touched_log_entry_t entry;
+    entry.addr_type = (unsigned long)addr | access_type;
+    entry.stamp = stamp;
+    if (touched_log_slot >= 0) {
+	// single producer ring, drained by collect_touched()
+	touched_log_t &log = touched_logs[touched_log_slot];
+	unsigned long tail = log.tail.load(std::memory_order_relaxed);
+	if (tail - log.head.load(std::memory_order_acquire) < touched_log_capacity) {
+	    log.entries[tail % touched_log_capacity] = entry;
+	    log.tail.store(tail + 1, std::memory_order_release);
+	    return;
+	}
+    }
+    // never page_lock, so that callers may hold it
+    while (touched_overflow_lock.test_and_set(std::memory_order_acquire))
+	;
+    if (touched_overflow_size < touched_log_capacity)
+	touched_overflow[touched_overflow_size++] = entry;
+    else
+	touched_lost = true;
+    touched_overflow_lock.clear(std::memory_order_release);
+}
+
+// access types fit below the page offset
+static const unsigned long LOG_TYPE_MASK = 7;
+
+static bool log_address_comparator(const region_manager::touched_log_entry_t &e1,
+				   const region_manager::touched_log_entry_t &e2) {
+    unsigned long a1 = e1.addr_type & ~LOG_TYPE_MASK, a2 = e2.addr_type & ~LOG_TYPE_MASK;
+    if (a1 != a2)
+	return a1 < a2;
+    return e1.stamp < e2.stamp;
+}
+
+static bool log_stamp_comparator(const region_manager::touched_log_entry_t &e1,
+				 const region_manager::touched_log_entry_t &e2) {
+    return e1.stamp < e2.stamp;
+}
+
+void region_manager::collect_touched() {
+    std::vector<touched_log_entry_t> merged;
+
+    // the ring of an exited thread is drained one last time before its slot is given back
+    for (unsigned int i = 0; i < MAX_TOUCHED_LOGS; i++) {
+	touched_log_t &log = touched_logs[i];
+	pid_t orphan = touched_log_orphan(i);
+	unsigned long head = log.head.load(std::memory_order_relaxed);
+	unsigned long tail = log.tail.load(std::memory_order_acquire);
+	for (unsigned long j = head; j < tail; j++)
+	    merged.push_back(log.entries[j % touched_log_capacity]);
+	log.head.store(tail, std::memory_order_release);
+	// another region manager may have given it back already
+	if (orphan != 0 && touched_log_owner[i].compare_exchange_strong(orphan, 0))
+	    touched_log_busy.fetch_and(~((boost::uint64_t)1 << i));
+    }
+    bool lost;
+    while (touched_overflow_lock.test_and_set(std::memory_order_acquire))
+	;
+    merged.insert(merged.end(), touched_overflow, touched_overflow + touched_overflow_size);
+    touched_overflow_size = 0;
+    lost = touched_lost;
+    touched_lost = false;
+    touched_overflow_lock.clear(std::memory_order_release);
+    if (lost) {
+	ERROR("touched pages overflowed the logs, the next checkpoint takes every page");
+	boost::mutex::scoped_lock lock(page_lock);
+	new_touched.clear();
+	for (page_map_t::iterator p_it = pages.begin(); p_it != pages.end(); p_it++)
+	    new_touched.push_back(touched_entry_t(p_it->first, PAGE_AFTER));
+	return;
+    }
+    // threads racing on the same page may both log it: keep the earliest, then restore fault order
+    std::sort(merged.begin(), merged.end(), &log_address_comparator);
+    unsigned int unique = 0;
+    for (unsigned int i = 0; i < merged.size(); i++)
+	if (unique == 0 || (merged[i].addr_type & ~LOG_TYPE_MASK) != (merged[unique - 1].addr_type & ~LOG_TYPE_MASK))
+	    merged[unique++] = merged[i];
+    merged.resize(unique);
+    std::stable_sort(merged.begin(), merged.end(), &log_stamp_comparator);
+    new_touched.clear();
+    new_touched.reserve(merged.size());
+    for (unsigned int i = 0; i < merged.size(); i++)
+	new_touched.push_back(touched_entry_t((char *)(merged[i].addr_type & ~LOG_TYPE_MASK),
+					      merged[i].addr_type & LOG_TYPE_MASK));
+}
+
+void region_manager::set_group_name(const std::string &name) {
+    wait_for_completion();
+    group_name = name;
+}
+
+void region_manager::set_dedup_report(bool flag) {
+    dedup_report_flag = flag;
+}
+
+void region_manager::set_flush_bandwidth(boost::uint64_t bandwidth, bool adaptive) {
+    wait_for_completion();
+    delete governor;
+    governor = bandwidth > 0 ? new flush_governor(page_size, bandwidth, adaptive) : NULL;
+}
+
+void region_manager::set_urgent_window(unsigned int window) {
+    boost::mutex::scoped_lock lock(page_lock);
+    urgent_window = window;
+}
+
+bool region_manager::enable_trace(const std::string &trace_dir, unsigned long entries) {
+    std::ostringstream ss;
+    ss << trace_dir << "/blobcr-trace-";
+    if (group_name != "")
+	ss << group_name << "-";
+    ss << mpi_comm_world.rank() << ".dat";
+    trace = new ckpt_trace(ss.str(), entries);
+    if (!trace->good()) {
+	delete trace;
+	trace = NULL;
+	return false;
+    }
+    boost::uint8_t flags = (incremental_flag ? ckpt_trace::TRACE_INCREMENTAL : 0) |
+	(access_order_flag ? ckpt_trace::TRACE_ACCESS_ORDER : 0) |
+	(learned_order_flag ? ckpt_trace::TRACE_LEARNED_ORDER : 0);
+    trace->record(ckpt_trace::TRACE_START, flags, (void *)cow_threshold, page_size, ckpt_stats::now_ns());
+    // regions tracked before the trace started
+    boost::mutex::scoped_lock lock(page_lock);
+    for (page_map_t::iterator p_it = pages.begin(); p_it != pages.end(); p_it++)
+	trace->record(ckpt_trace::REGION_ADD, 0, p_it->first, 1, ckpt_stats::now_ns());
+    return true;
+}
+
+void region_manager::set_speculation(unsigned int max_window) {
+    boost::mutex::scoped_lock lock(page_lock);
+    speculate_window = std::min(max_window, MAX_SPECULATE_WINDOW);
+}
+
+bool region_manager::enable_partner_copy(const std::string &store_prefix, boost::uint64_t mem_limit) {
+    // the writer thread streams to the buddy while the application may use MPI as well
+    if (boost::mpi::environment::thread_level() != boost::mpi::threading::multiple) {
+	ERROR("partner copies need MPI_THREAD_MULTIPLE");
+	return false;
+    }
+    if (mpi_comm_world.size() < 2) {
+	ERROR("partner copies need at least two ranks");
+	return false;
+    }
+    wait_for_completion();
+    partner = new partner_replicator(mpi_comm_world, store_prefix, page_size << 8, mem_limit, incremental_flag);
+    INFO("partner copies of rank " << mpi_comm_world.rank() << " go to rank " << partner->get_buddy());
+    return true;
+}
+
+bool region_manager::restore_partner_copy(int seq, const std::string &file_name) {
+    wait_for_completion();
+    if (partner == NULL)
+	return false;
+    return partner->restore(seq, file_name);
+}
+
+bool region_manager::enable_shared_file(unsigned int group_size, unsigned int aggregators) {
+    if (boost::mpi::environment::thread_level() != boost::mpi::threading::multiple) {
+	ERROR("shared checkpoint files need MPI_THREAD_MULTIPLE");
+	return false;
+    }
+    // the shared file replaces the per-rank images the local tier and the rebuild path work on
+    if (drainer != NULL || coder != NULL) {
+	ERROR("shared checkpoint files cannot be combined with the local tier or erasure coding");
+	return false;
+    }
+    wait_for_completion();
+    shared = new shared_writer(mpi_comm_world, group_size, aggregators, page_size << 10);
+    return true;
+}
+
+bool region_manager::enable_stagger(unsigned int wave, double fs_bandwidth) {
+    // buddies, parity groups and shared files need their peers to flush at the same time
+    if (partner != NULL || coder != NULL || shared != NULL) {
+	ERROR("staggered flushes cannot be combined with partner copies, erasure coding or shared files");
+	return false;
+    }
+    if (boost::mpi::environment::thread_level() != boost::mpi::threading::multiple) {
+	ERROR("staggered flushes need MPI_THREAD_MULTIPLE");
+	return false;
+    }
+    wait_for_completion();
+    stagger = new flush_stagger(mpi_comm_world, wave, fs_bandwidth);
+    return true;
+}
+
+bool region_manager::enable_erasure_coding(int group_size, int parity) {
+    if (boost::mpi::environment::thread_level() != boost::mpi::threading::multiple) {
+	ERROR("erasure coding needs MPI_THREAD_MULTIPLE");
+	return false;
+    }
+    wait_for_completion();
+    coder = new erasure_coder(mpi_comm_world, group_size, parity, page_size << 4);
+    if (!coder->is_usable()) {
+	delete coder;
+	coder = NULL;
+	return false;
+    }
+    return true;
+}
+
+bool region_manager::rebuild_erasure_coded(int seq) {
+    wait_for_completion();
+    if (coder == NULL)
+	return false;
+    std::string prefix = drainer != NULL ? ckpt_local_prefix : ckpt_path_prefix;
+    return coder->rebuild(ckpt_file_name(prefix, "ckpt", seq), ckpt_file_name(prefix, "parity", seq));
+}
+
+void region_manager::enable_local_tier(const std::string &local_prefix, boost::uint64_t capacity,
+				       boost::uint64_t bandwidth) {
+    wait_for_completion();
+    ckpt_local_prefix = local_prefix;
+    drainer = new ckpt_drainer(capacity, bandwidth);
+}
+
+int region_manager::get_drained_checkpoint() {
+    if (drainer == NULL)
+	return (int)seq_no - 1;
+    return drainer->get_last_drained();
+}
+
+void region_manager::wait_for_drain() {
+    wait_for_completion();
+    if (drainer != NULL)
+	drainer->wait_for_drain();
+}
+
+bool region_manager::enable_fork_snapshot() {
+    // the writer pushes pages to the buddy, parity and shared file and fingerprints them over MPI,
+    // none of which a forked child can take part in
+    if (partner != NULL || coder != NULL || shared != NULL || dedup_flag) {
+	ERROR("fork snapshots cannot be combined with partner copies, erasure coding, shared files or dedup");
+	return false;
+    }
+    wait_for_completion();
+    boost::mutex::scoped_lock lock(page_lock);
+    // nothing is tracked without write protection, so every checkpoint is a full one
+    if (incremental_flag)
+	for (page_map_t::iterator p_it = pages.begin(); p_it != pages.end(); p_it++)
+	    mprotect(p_it->first, page_size, PROT_READ | PROT_WRITE);
+    incremental_flag = access_order_flag = learned_order_flag = false;
+    fork_flag = true;
+    return true;
+}
+
+bool region_manager::enable_hierarchical_dedup() {
+    if (!global_dedup_flag)
+	return false;
+    dup_engine->enable_hierarchical();
+    return true;
+}
+
+bool region_manager::enable_numa() {
+    unsigned int nodes = numa_policy::nodes();
+    if (nodes < 2)
+	return false;
+    wait_for_completion();
+    // COW copies go to the node of their source page, so the node writers read them locally
+    simple_sweep_allocator::split_nodes(nodes);
+    node_pages.resize(nodes);
+    for (unsigned int i = 1; i < nodes; i++)
+	node_writers.create_thread(boost::bind(&region_manager::node_writer_exec, this, i));
+    numa_nodes = nodes;
+    return true;
+}
+
+void region_manager::enable_scheduler(double mtbf) {
+    if (scheduler != NULL || mtbf <= 0)
+	return;
+    scheduler = new ckpt_scheduler(mtbf);
+}
+
+bool region_manager::enable_spill(const std::string &spill_dir, boost::uint64_t spill_mem) {
+    boost::mutex::scoped_lock lock(page_lock);
+    if (!spill_allocator::init(page_size, spill_dir.c_str(), spill_mem))
+	return false;
+    spill_threshold = spill_mem / page_size;
+    ckpt_stats::set_capacity(ckpt_stats::SPILL_PAGES, spill_threshold);
+    return true;
 }
 
 bool region_manager::add_region(const void *buff, boost::uint64_t size) {
@@ -77,8 +512,11 @@ bool region_manager::add_region(const void *buff, boost::uint64_t size) {
 	pages.insert(page_entry_t(addr, page_info_t()));
 	total_mem_size += page_size;
     }
-    if (incremental_flag)
+    update_regions((unsigned long)buff, (unsigned long)addr, true);
+    if (incremental_flag || fingerprint_cache_flag)
 	mprotect((void *)buff, size, PROT_READ);
+    if (trace != NULL)
+	trace->record(ckpt_trace::REGION_ADD, 0, buff, size / page_size, ckpt_stats::now_ns());
 
     return (addr < (char *)buff + size);
 }
@@ -95,13 +533,84 @@ boost::uint64_t region_manager::remove_region(const void *buff,
 	    while (p_it->second.state != PAGE_COMMITTED)
 		page_cond.wait(lock);
 	    pages.erase(p_it);
+	    if (fingerprint_cache_flag)
+		untracked_pages.push_back(addr);
 	}
 	total_mem_size -= page_size;
     }
+    {
+	boost::mutex::scoped_lock lock(page_lock);
+	update_regions((unsigned long)buff, (unsigned long)buff + size, false);
+    }
     mprotect((void *)buff, size, PROT_READ | PROT_WRITE);
+    if (trace != NULL)
+	trace->record(ckpt_trace::REGION_REMOVE, 0, buff, size / page_size, ckpt_stats::now_ns());
     return size;
 }
 
+// called with page_lock held; a lookup announces itself in region_readers before loading the
+// set, so none can still hold a replaced copy once the count is seen at zero after the swap
+void region_manager::update_regions(unsigned long start, unsigned long end, bool add) {
+    region_set_t *old = regions.load(), *next = new region_set_t();
+
+    for (region_set_t::iterator r_it = old->begin(); r_it != old->end(); r_it++) {
+	if (r_it->second < start || r_it->first > end) {
+	    next->push_back(*r_it);
+	    continue;
+	}
+	// overlapping or adjacent: merged into the new range, or cut around the removed one
+	if (add) {
+	    start = std::min(start, r_it->first);
+	    end = std::max(end, r_it->second);
+	    continue;
+	}
+	if (r_it->first < start)
+	    next->push_back(std::make_pair(r_it->first, start));
+	if (r_it->second > end)
+	    next->push_back(std::make_pair(end, r_it->second));
+    }
+    if (add)
+	next->insert(std::lower_bound(next->begin(), next->end(), std::make_pair(start, end)),
+		     std::make_pair(start, end));
+    regions.store(next);
+    retired_regions.push_back(old);
+    if (region_readers.load() == 0) {
+	for (unsigned int i = 0; i < retired_regions.size(); i++)
+	    delete retired_regions[i];
+	retired_regions.clear();
+    }
+}
+
+// safe in the fault handler: no lock, no allocation
+bool region_manager::tracks(void *addr) {
+    region_readers++;
+    region_set_t *set = regions.load();
+    region_set_t::iterator r_it = std::upper_bound(set->begin(), set->end(),
+						   std::make_pair((unsigned long)addr, (unsigned long)-1));
+    bool found = r_it != set->begin() && (unsigned long)addr < (r_it - 1)->second;
+    region_readers--;
+    return found;
+}
+
+void region_manager::prefault(void *buff, size_t size) {
+    // fork snapshots never protect anything
+    if (fork_flag || size == 0)
+	return;
+    unsigned long start = (unsigned long)buff, end = start + size;
+    region_readers++;
+    region_set_t *set = regions.load();
+    region_set_t::iterator r_it = std::upper_bound(set->begin(), set->end(),
+						   std::make_pair(start, (unsigned long)-1));
+    if (r_it != set->begin())
+	r_it--;
+    for (; r_it != set->end() && r_it->first < end; r_it++)
+	for (unsigned long addr = std::max(start, r_it->first); addr < std::min(end, r_it->second);
+	     addr = (addr / page_size + 1) * page_size)
+	    // a no-op atomic write takes the usual fault path without racing with other writers
+	    __sync_fetch_and_or((char *)addr, 0);
+    region_readers--;
+}
+
 bool region_manager::handle_segfault(void *addr) {
     char *buff = (char *)(((unsigned long)addr / page_size) * page_size);
 
@@ -111,44 +620,93 @@ bool region_manager::handle_segfault(void *addr) {
 	    "), aborting...");
 	return false;	
     }
+    boost::uint64_t fault_start = ckpt_stats::now_ns();
+    boost::mutex::scoped_lock lock(page_lock, boost::defer_lock);
+
+    // compare against the faults an address-ordered flush of the same set would have caused,
+    // assuming the writer commits pages at the same rate; ranks only exist with a learned order
+    if (checkpoint_in_progress && learned_order_flag) {
+	lock.lock();
+	if (p_it->second.addr_rank != NO_RANK) {
+	    if (p_it->second.state != PAGE_COMMITTED)
+		stats_order_faults++;
+	    if (p_it->second.addr_rank >= no_blocks)
+		stats_addr_order_faults++;
+	    p_it->second.addr_rank = NO_RANK;
+	}
+    }
 
     char access_type;
+    int fault_type;
     if (p_it->second.state != PAGE_COMMITTED) {
-	boost::mutex::scoped_lock lock(page_lock);
-	if (p_it->second.state == PAGE_SCHEDULED && stats_page_cow < cow_threshold) {
-	    char *new_page = simple_sweep_allocator::malloc(page_size);
-	    ASSERT(new_page != NULL);
+	if (!lock.owns_lock())
+	    lock.lock();
+	char *new_page = NULL;
+	// the COW pool is shared with the other checkpoint groups, so it may run out before the quota
+	if (p_it->second.state == PAGE_SCHEDULED && stats_page_cow < cow_threshold &&
+	    (new_page = simple_sweep_allocator::malloc(page_size, numa_nodes > 1 ? numa_policy::node_of(buff) : -1)) != NULL) {
 	    memcpy(new_page, buff, page_size);
 	    p_it->second.cow_ptr = new_page;
 	    access_type = PAGE_COW;
+	    fault_type = ACFTE_FAULT_COW;
 	    stats_page_cow++;
+	    ckpt_stats::gauge_add(ckpt_stats::COW_PAGES, 1);
+	} else if (p_it->second.state == PAGE_SCHEDULED && stats_page_spill < spill_threshold &&
+		   (new_page = spill_allocator::malloc(page_size)) != NULL) {
+	    // COW pool exhausted: copy into the local spill area instead of waiting for the flush
+	    memcpy(new_page, buff, page_size);
+	    p_it->second.cow_ptr = new_page;
+	    access_type = PAGE_COW;
+	    fault_type = ACFTE_FAULT_SPILL;
+	    stats_page_spill++;
+	    ckpt_stats::gauge_add(ckpt_stats::SPILL_PAGES, 1);
 	} else if (p_it->second.state == PAGE_COMMITTED) {
 	    if (checkpoint_in_progress) {
 		access_type = PAGE_AFTER;
+		fault_type = ACFTE_FAULT_AFTER;
 		stats_page_after++;
 	    } else {
 		access_type = PAGE_DELAYED;
+		fault_type = ACFTE_FAULT_DELAYED;
 		stats_page_delayed++;
 	    }
 	} else {
+	    // no COW room left: ask the writer to flush this page next
+	    boost::uint64_t wait_start = ckpt_stats::now_ns();
+	    if (p_it->second.state == PAGE_SCHEDULED && urgent_tail - urgent_head < URGENT_RING)
+		urgent[urgent_tail++ % URGENT_RING] = buff;
 	    while (p_it->second.state != PAGE_COMMITTED)
 		page_cond.wait(lock);
+	    boost::uint64_t wait_us = (ckpt_stats::now_ns() - wait_start) / 1000;
+	    if (wait_us > stats_max_wait_us)
+		stats_max_wait_us = wait_us;
 	    access_type = PAGE_WAIT;
+	    fault_type = ACFTE_FAULT_WAIT;
 	    stats_page_wait++;
 	}
     } else {
 	if (checkpoint_in_progress) {
 	    access_type = PAGE_AFTER;
+	    fault_type = ACFTE_FAULT_AFTER;
 	    stats_page_after++;
 	} else {
 	    access_type = PAGE_DELAYED;
+	    fault_type = ACFTE_FAULT_DELAYED;
 	    stats_page_delayed++;
 	}
     }
+    if (lock.owns_lock())
+	lock.unlock();
 
-    if (incremental_flag || access_type == PAGE_COW)
+    if (incremental_flag || fingerprint_cache_flag || access_type == PAGE_COW)
 	mprotect(buff, page_size, PROT_READ | PROT_WRITE);
-    new_touched.push_back(touched_entry_t(buff, access_type));    
+    log_touched(buff, access_type, fault_start);
+    if (speculate_window > 0)
+	speculate(buff, fault_start);
+    boost::uint64_t fault_ns = ckpt_stats::now_ns() - fault_start;
+    ckpt_stats::record_fault(fault_type, fault_ns);
+    if (trace != NULL)
+	trace->record(ckpt_trace::FAULT, fault_type, buff, fault_ns, fault_start);
 
     return true;
 }
@@ -159,19 +717,211 @@ void region_manager::wait_for_completion() {
 	work_cond.wait(lock);
 }
 
+bool region_manager::checkpoint_test(int id) {
+    boost::mutex::scoped_lock lock(work_lock);
+    return id < (int)seq_no;
+}
+
+void region_manager::checkpoint_wait(int id) {
+    boost::mutex::scoped_lock lock(work_lock);
+    while (id >= (int)seq_no && checkpoint_in_progress)
+	work_cond.wait(lock);
+}
+
+void region_manager::speculate(char *buff, boost::uint64_t stamp) {
+    long reach = MAX_STREAM_STRIDE * page_size, nearest = 0;
+    fault_stream_t *s = NULL, *victim = &fault_streams[0];
+
+    for (unsigned int i = 0; i < FAULT_STREAMS && s == NULL; i++)
+	if (fault_streams[i].owner == this && fault_streams[i].next == buff)
+	    s = &fault_streams[i];
+    if (s != NULL)
+	// the stream went past everything handled ahead of it, look further
+	s->window = std::min(s->window * 2, speculate_window);
+    else {
+	// the stream expecting its next fault nearest to this one, so that streams whose
+	// windows overlap do not take over each other's faults
+	for (unsigned int i = 0; i < FAULT_STREAMS; i++) {
+	    fault_stream_t &e = fault_streams[i];
+	    if (e.owner == this && e.last == buff)
+		return;
+	    long distance = labs(buff - (e.last + e.stride));
+	    if (e.owner == this && labs(buff - e.last) <= reach && (s == NULL || distance < nearest)) {
+		s = &e;
+		nearest = distance;
+	    }
+	    if (e.used < victim->used)
+		victim = &e;
+	}
+	// a stride is only ever confirmed, a fault off it starts a stream of its own and the
+	// old one ages out if it really turned away
+	if (s == NULL || (nearest != 0 && s->stride != 0)) {
+	    victim->owner = this;
+	    victim->last = buff;
+	    victim->next = NULL;
+	    victim->stride = 0;
+	    victim->repeats = 0;
+	    victim->window = 1;
+	    victim->used = stamp;
+	    return;
+	}
+	s->next = NULL;
+	if (s->stride == 0)
+	    s->stride = buff - s->last;
+	else
+	    s->repeats++;
+	if (s->repeats < STREAM_CONFIRM) {
+	    s->last = buff;
+	    s->used = stamp;
+	    return;
+	}
+    }
+    s->used = stamp;
+    s->last = buff;
+
+    // handle the window as if each page had faulted, unprotecting adjacent pages at once
+    unsigned int ahead = 0, handled = 0;
+    char *run = NULL;
+    size_t run_len = 0;
+    char *handled_addr[MAX_SPECULATE_WINDOW], handled_type[MAX_SPECULATE_WINDOW];
+    boost::mutex::scoped_lock lock(page_lock);
+    for (; ahead < s->window; ahead++) {
+	char *addr = buff + (ahead + 1) * s->stride;
+	page_map_t::iterator p_it = pages.find(addr);
+	if (p_it == pages.end())
+	    break;
+	char access_type;
+	if (p_it->second.state == PAGE_SCHEDULED) {
+	    char *new_page;
+	    // only while COW room is left, and not for pages already copied by a fault
+	    if (p_it->second.cow_ptr != NULL || stats_page_cow >= cow_threshold ||
+		(new_page = simple_sweep_allocator::malloc(page_size, numa_nodes > 1 ? numa_policy::node_of(addr) : -1)) == NULL)
+		break;
+	    memcpy(new_page, addr, page_size);
+	    p_it->second.cow_ptr = new_page;
+	    access_type = PAGE_COW;
+	    stats_page_cow++;
+	    ckpt_stats::gauge_add(ckpt_stats::COW_PAGES, 1);
+	} else if (p_it->second.state == PAGE_COMMITTED) {
+	    // already writable, it would not fault either
+	    if (!incremental_flag && !fingerprint_cache_flag)
+		continue;
+	    access_type = checkpoint_in_progress ? PAGE_AFTER : PAGE_DELAYED;
+	} else
+	    break;
+	handled_addr[handled] = addr;
+	handled_type[handled] = access_type;
+	handled++;
+	if (run != NULL && addr == run + run_len)
+	    run_len += page_size;
+	else if (run != NULL && addr + page_size == run) {
+	    run = addr;
+	    run_len += page_size;
+	} else {
+	    if (run != NULL)
+		mprotect(run, run_len, PROT_READ | PROT_WRITE);
+	    run = addr;
+	    run_len = page_size;
+	}
+    }
+    // still under the lock, so a fault on one of them cannot copy it a second time
+    if (run != NULL)
+	mprotect(run, run_len, PROT_READ | PROT_WRITE);
+    lock.unlock();
+    // logged like the faults themselves, outside page_lock
+    for (unsigned int i = 0; i < handled; i++) {
+	log_touched(handled_addr[i], handled_type[i], stamp);
+	if (trace != NULL)
+	    trace->record(ckpt_trace::FAULT, ckpt_trace::FAULT_SPECULATED, handled_addr[i], 0, stamp);
+    }
+    s->next = ahead > 0 ? buff + (ahead + 1) * s->stride : NULL;
+    ckpt_stats::count(ckpt_stats::PAGES_SPECULATED, handled);
+}
+
+// pages the next checkpoint would have to write if it started now
+unsigned long region_manager::dirty_pages() {
+    if (!incremental_flag)
+	return total_mem_size / page_size;
+    unsigned long dirty = 0;
+    for (unsigned int i = 0; i < MAX_TOUCHED_LOGS; i++)
+	dirty += touched_logs[i].tail.load(std::memory_order_relaxed) -
+	    touched_logs[i].head.load(std::memory_order_relaxed);
+    while (touched_overflow_lock.test_and_set(std::memory_order_acquire))
+	;
+    dirty += touched_lost ? total_mem_size / page_size : touched_overflow_size;
+    touched_overflow_lock.clear(std::memory_order_release);
+    return dirty;
+}
+
+int region_manager::checkpoint_if_due(callback_t callback, void *arg) {
+    // every rank has to take part in the same checkpoints (partner copies, parity, shared
+    // files, waves, global dedup), so the ranks agree: -1 = still flushing, 0 = due, 1 = not due
+    int state;
+    if (scheduler == NULL)
+	return -1;
+    {
+	// a safe point never blocks on the flush of the previous checkpoint
+	boost::mutex::scoped_lock lock(work_lock);
+	state = checkpoint_in_progress ? -1 : 1;
+    }
+    if (state == 1 && scheduler->due(dirty_pages(), ckpt_stats::now_ns()))
+	state = 0;
+    // all of them done flushing, and due for at least one: a blocking all_reduce of one int at every
+    // call, which only pays off at safe points much further apart than its latency
+    state = boost::mpi::all_reduce(mpi_comm_world, state, boost::mpi::minimum<int>());
+    if (state != 0)
+	return -1;
+    return checkpoint_async(callback, arg);
+}
+
 bool region_manager::checkpoint() {
+    int id = checkpoint_async();
+    checkpoint_wait(id);
+    return id != -1;
+}
+
+int region_manager::checkpoint_async(callback_t callback, void *arg) {
     // first wait for the previous checkpoint to complete (if necessary)
     wait_for_completion();
 
     INFO("CHECKPOINT STARTED - " << construct_stats());
+    boost::uint64_t setup_start = ckpt_stats::now_ns();
+    if (fork_flag) {
+	if (snapshot_async() == -1)
+	    return -1;
+	boost::uint64_t setup_ns = ckpt_stats::now_ns() - setup_start;
+	ckpt_stats::count(ckpt_stats::SETUP_NS, setup_ns);
+	if (scheduler != NULL)
+	    scheduler->started(setup_start, setup_ns);
+	return start_writer(callback, arg);
+    }
 
     // reset statistics
-    stats_page_cow = stats_page_wait = stats_page_after = stats_page_delayed = 0;
+    stats_page_cow = stats_page_spill = stats_page_wait = stats_page_after = stats_page_delayed = 0;
+    stats_order_faults = stats_addr_order_faults = stats_urgent = 0;
+    stats_max_wait_us = 0;
+    collect_touched();
+    if (learned_order_flag)
+	learn_order();
     touched = new_touched;
     new_touched.clear();
+    if (fingerprint_cache_flag) {
+	for (touched_t::iterator t_it = touched.begin(); t_it != touched.end(); t_it++)
+	    dup_engine->invalidate(t_it->first);
+	boost::mutex::scoped_lock lock(page_lock);
+	for (unsigned int i = 0; i < untracked_pages.size(); i++)
+	    dup_engine->invalidate(untracked_pages[i]);
+	untracked_pages.clear();
+    }
+
+    // with pipelining, everything is protected now and fingerprinted by the writer; shared files
+    // and parity need the final page count up front, a global dedup needs MPI from the writer
+    dedup_pipelined = dedup_flag && shared == NULL && coder == NULL &&
+	(!global_dedup_flag || boost::mpi::environment::thread_level() == boost::mpi::threading::multiple);
 
     // de-duplication
-    if (dedup_flag) {
+    if (dedup_flag && !dedup_pipelined) {
+	boost::uint64_t dedup_start = ckpt_stats::now_ns();
 	dup_engine->clear();
 	if (incremental_flag)
 	    for (touched_t::iterator t_it = touched.begin(); t_it != touched.end(); t_it++) {
@@ -183,54 +933,170 @@ bool region_manager::checkpoint() {
 	    for (page_map_t::iterator p_it = pages.begin(); p_it != pages.end(); p_it++)
 		dup_engine->process_page(p_it->first);
 	dup_engine->finalize_local();
-	if (global_dedup_flag)
+	boost::uint64_t dedup_local_end = ckpt_stats::now_ns();
+	ckpt_stats::count(ckpt_stats::DEDUP_LOCAL_NS, dedup_local_end - dedup_start);
+	if (global_dedup_flag) {
 	    dup_engine->global_dedup();
+	    ckpt_stats::count(ckpt_stats::DEDUP_GLOBAL_NS, ckpt_stats::now_ns() - dedup_local_end);
+	}
+	const stats_t &dup_stats = dup_engine->get_local_stats();
+	ckpt_stats::set_dedup(dup_stats.total, dup_stats.local, dup_stats.global);
 
-	// optionally display some stats:
-	std::string dup_stats = dup_engine->get_stats();
-	if (dup_stats != "")
-	    DBG("DEDUP statistics: " << dup_stats);
+	// the aggregated report is an extra collective, only pay for it on request
+	if (dedup_report_flag) {
+	    std::string report = dup_engine->get_stats();
+	    if (report != "")
+		DBG("DEDUP statistics: " << report);
+	}
     }
 
-    // schedule pages for eviction
+    // schedule pages for eviction; duplicates dropped by a non-pipelined dedup are scheduled as
+    // well, to take their place in the flush order, but do not count as pages to write
+    no_scheduled = 0;
     if (incremental_flag) {
 	for (page_map_t::iterator p_it = pages.begin(); p_it != pages.end(); p_it++)
 	    mprotect(p_it->first, page_size, PROT_READ);
 	for (touched_t::iterator t_it = touched.begin(); t_it != touched.end(); t_it++) {
 	    page_map_t::iterator p_it = pages.find(t_it->first);
-	    if (p_it != pages.end() && (!dedup_flag || dup_engine->check_page(p_it->first)))
-		p_it->second.state = PAGE_SCHEDULED;
+	    if (p_it == pages.end())
+		continue;
+	    p_it->second.dropped = dedup_flag && !dedup_pipelined && !dup_engine->check_page(p_it->first);
+	    p_it->second.state = PAGE_SCHEDULED;
+	    if (!p_it->second.dropped)
+		no_scheduled++;
 	}
     } else
-	for (page_map_t::iterator p_it = pages.begin(); p_it != pages.end(); p_it++)
-	    if (!dedup_flag || dup_engine->check_page(p_it->first)) {
-		mprotect(p_it->first, page_size, PROT_READ);
-		p_it->second.state = PAGE_SCHEDULED;
-	    }
+	for (page_map_t::iterator p_it = pages.begin(); p_it != pages.end(); p_it++) {
+	    mprotect(p_it->first, page_size, PROT_READ);
+	    p_it->second.dropped = dedup_flag && !dedup_pipelined && !dup_engine->check_page(p_it->first);
+	    p_it->second.state = PAGE_SCHEDULED;
+	    if (!p_it->second.dropped)
+		no_scheduled++;
+	}
+
+    boost::uint64_t setup_ns = ckpt_stats::now_ns() - setup_start;
+    ckpt_stats::count(ckpt_stats::SETUP_NS, setup_ns);
+    if (scheduler != NULL)
+	scheduler->started(setup_start, setup_ns);
+    return start_writer(callback, arg);
+}
 
+int region_manager::start_writer(callback_t callback, void *arg) {
     // signal the io thread to begin processing
     no_blocks = 0;
-    checkpoint_in_progress = true;
-    work_cond.notify_one();
-    
-    // optionally block until checkpointing is complete
-    boost::this_thread::yield();
-    wait_for_completion();
+    ckpt_stats::count(ckpt_stats::CHECKPOINTS);
+    if (trace != NULL)
+	trace->record(ckpt_trace::CKPT_BEGIN, 0, NULL, no_scheduled, ckpt_stats::now_ns());
+    int id;
+    {
+	boost::mutex::scoped_lock lock(work_lock);
+	id = seq_no;
+	ckpt_callback = callback;
+	ckpt_callback_arg = arg;
+	checkpoint_in_progress = true;
+	work_cond.notify_one();
+    }
     
-    return true;
+    return id;
+}
+
+// runs in the forked child, which only has this thread: no locks, no allocation, no MPI
+static void write_snapshot(const char *name, char * const *pages, size_t count, size_t page_size) {
+    int fd = open(name, O_WRONLY | O_TRUNC | O_CREAT, 0666);
+    if (fd == -1)
+	_exit(1);
+    for (size_t i = 0; i < count; ) {
+	// pages are in address order, adjacent ones go out in a single write
+	size_t run = 1;
+	while (i + run < count && pages[i + run] == pages[i] + run * page_size)
+	    run++;
+	char *buff = pages[i];
+	size_t left = run * page_size;
+	while (left > 0) {
+	    ssize_t result = write(fd, buff, left);
+	    if (result == -1 && errno == EINTR)
+		continue;
+	    if (result == -1)
+		_exit(1);
+	    buff += result;
+	    left -= result;
+	}
+	i += run;
+    }
+    _exit(close(fd) == 0 ? 0 : 1);
+}
+
+int region_manager::snapshot_async() {
+    std::string prefix = drainer != NULL ? ckpt_local_prefix : ckpt_path_prefix;
+    snapshot_name = ckpt_file_name(prefix, "ckpt", seq_no);
+    pid_t pid;
+    {
+	// regions cannot go away between listing them and forking
+	boost::mutex::scoped_lock lock(page_lock);
+	snapshot_pages.clear();
+	snapshot_pages.reserve(pages.size());
+	for (page_map_t::iterator p_it = pages.begin(); p_it != pages.end(); p_it++)
+	    snapshot_pages.push_back(p_it->first);
+	std::sort(snapshot_pages.begin(), snapshot_pages.end());
+	pid = fork();
+	if (pid == 0)
+	    write_snapshot(snapshot_name.c_str(), snapshot_pages.data(), snapshot_pages.size(), page_size);
+    }
+    if (pid == -1) {
+	ERROR("could not fork the snapshot writer: " << strerror(errno));
+	return -1;
+    }
+    snapshot_pid = pid;
+    return 0;
+}
+
+bool region_manager::wait_snapshot() {
+    int status = 0;
+    while (waitpid(snapshot_pid, &status, 0) == -1 && errno == EINTR)
+	boost::this_thread::interruption_point();
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+	no_blocks = snapshot_pages.size();
+	ckpt_stats::count(ckpt_stats::PAGES_FLUSHED, no_blocks);
+	ckpt_stats::count(ckpt_stats::BYTES_WRITTEN, (boost::uint64_t)no_blocks * page_size);
+    } else
+	ERROR("snapshot writer " << snapshot_pid << " failed to write " << snapshot_name);
+    snapshot_pid = 0;
+    return no_blocks == snapshot_pages.size();
 }
 
 std::string region_manager::construct_stats() {
     std::stringstream ss;
 
-    ss << "rank = " << mpi_comm_world.rank() << 
+    ss << "rank = " << mpi_comm_world.rank();
+    if (group_name != "")
+	ss << ", group = " << group_name;
+    ss << 
 	", total_tracked = " << (total_mem_size / (1 << 20)) << "MB" <<
 	", seq_no = " << seq_no <<
 	", pages_cow = " << stats_page_cow << 
+	", pages_spill = " << stats_page_spill <<
 	", pages_wait = " << stats_page_wait <<
+	", max_wait = " << stats_max_wait_us << "us" <<
+	", urgent_flushed = " << stats_urgent <<
 	", pages_after = " << stats_page_after <<
 	", pages_delayed = " << stats_page_delayed <<
+	", ordered_faults = " << stats_order_faults <<
+	", est_addr_order_faults = " << stats_addr_order_faults <<
+	", est_faults_avoided = " << ((long)stats_addr_order_faults - (long)stats_order_faults) <<
 	", committed_pages = " << no_blocks;
+    if (partner != NULL)
+	ss << ", " << partner->get_stats();
+    if (coder != NULL)
+	ss << ", " << coder->get_stats();
+    if (stagger != NULL)
+	ss << ", " << stagger->get_stats();
+    if (governor != NULL)
+	ss << ", flush_rate = " << (governor->get_rate() >> 20) << "MB/s";
+    if (scheduler != NULL) {
+	unsigned long dirty = dirty_pages();
+	ss << ", dirty_pages = " << dirty << ", est_cost = " << scheduler->cost(dirty) * 1000 << "ms" <<
+	    ", optimal_interval = " << scheduler->interval(dirty, ckpt_stats::now_ns()) << "s";
+    }
     
     return ss.str();
 }
@@ -239,9 +1105,10 @@ void region_manager::display_stats() {
     INFO("STATS SINCE LAST CKPT - " << construct_stats());
 }
 
-void region_manager::handle_page(char *addr, int fd) {
+void region_manager::handle_page(char *addr, int fd, bool discard) {
     char *buff;
     page_map_t::iterator p_it;
+    boost::uint64_t position, offset;
 
     {
 	boost::mutex::scoped_lock lock(page_lock);
@@ -254,10 +1121,15 @@ void region_manager::handle_page(char *addr, int fd) {
 	    buff = p_it->second.cow_ptr;
 	else
 	    buff = addr;
+	discard = discard || p_it->second.dropped;
+	// file order follows the flush order even with several writers
+	position = flush_position++;
+	offset = discard || fd == -1 ? 0 : flush_offset.fetch_add(page_size);
     }
+    boost::uint64_t flush_start = ckpt_stats::now_ns();
     ssize_t result; size_t progress = 0;
-    while (progress < page_size) {
-	result = write(fd, buff + progress, page_size - progress);
+    while (!discard && fd != -1 && progress < page_size) {
+	result = pwrite(fd, buff + progress, page_size - progress, offset + progress);
 	if (result == -1) {
 	    char msg[1024];
 	    sprintf(msg, "handle page %p", addr);
@@ -266,17 +1138,114 @@ void region_manager::handle_page(char *addr, int fd) {
 	ASSERT(result != -1);
 	progress += result;
     }
+    if (!discard) {
+	if (partner != NULL)
+	    partner->push(buff, page_size);
+	if (coder != NULL)
+	    coder->push(buff, page_size);
+	if (shared != NULL)
+	    shared->push(buff, page_size);
+    }
+    boost::uint64_t flush_end = ckpt_stats::now_ns();
+    if (trace != NULL)
+	trace->record(ckpt_trace::COMMIT, discard, addr, flush_end - flush_start, flush_end);
+    if (!discard) {
+	ckpt_stats::record_flush(flush_end - flush_start);
+	ckpt_stats::count(ckpt_stats::PAGES_FLUSHED);
+	ckpt_stats::count(ckpt_stats::BYTES_WRITTEN, page_size);
+    }
+    // unprotect before publishing the commit, otherwise a woken up waiter would spin on the fault
+    if (buff == addr && !incremental_flag && !fingerprint_cache_flag)
+	mprotect(buff, page_size, PROT_READ | PROT_WRITE);
     {
 	boost::mutex::scoped_lock lock(page_lock);
 	p_it->second.state = PAGE_COMMITTED;
 	p_it->second.cow_ptr = NULL;
-	page_cond.notify_one();
+	p_it->second.dropped = false;
+	if (!discard)
+	    no_blocks++;
+	if (fd != -1 && dedup_flag) {
+	    if (discard)
+		page_positions[addr] = position;
+	    else
+		page_offsets[addr] = offset;
+	}
+	page_cond.notify_all();
     }
-    if (buff != addr)
+    if (spill_allocator::contains(buff)) {
+	spill_allocator::free(buff);
+	ckpt_stats::gauge_add(ckpt_stats::SPILL_PAGES, -1);
+    } else if (buff != addr) {
 	simple_sweep_allocator::free(buff);
-    else if (!incremental_flag)
-	mprotect(buff, page_size, PROT_READ | PROT_WRITE);    
-    no_blocks++;
+	ckpt_stats::gauge_add(ckpt_stats::COW_PAGES, -1);
+    }
+}
+
+char region_manager::fingerprint_page(char *addr) {
+    boost::mutex::scoped_lock lock(page_lock);
+
+    page_map_t::iterator p_it = pages.find(addr);
+    // already flushed on behalf of a faulting thread
+    if (p_it == pages.end() || p_it->second.state != PAGE_SCHEDULED)
+	return PAGE_GONE;
+    char *snapshot = p_it->second.cow_ptr;
+    if (snapshot == NULL && !dup_engine->is_cached(addr)) {
+	// the page is still protected, so what is copied under the lock is exactly what a
+	// later fault would copy and the writer flush; hashing it does not hold up the faults
+	memcpy(fingerprint_buffer.data(), addr, page_size);
+	snapshot = fingerprint_buffer.data();
+    }
+    lock.unlock();
+    // a COW copy stays put until the writer itself commits the page, a cached fingerprint
+    // does not read the content at all
+    return dup_engine->process_page(addr, snapshot != NULL ? snapshot : addr) ? PAGE_UNIQUE : PAGE_DUPLICATE;
+}
+
+void region_manager::flush_deduplicated(const std::vector<char *> &order, int fd) {
+    std::vector<char *> ambiguous;
+
+    // local duplicates are certain to be dropped and, without a global pass, first copies
+    // certain to be kept: those are flushed right away, the rest waits for the collective
+    boost::uint64_t dedup_start = ckpt_stats::now_ns();
+    dup_engine->clear();
+    for (unsigned int i = 0; i < order.size(); i++) {
+	boost::this_thread::interruption_point();
+	flush_urgent(fd);
+	char outcome = fingerprint_page(order[i]);
+	if (outcome == PAGE_DUPLICATE)
+	    handle_page(order[i], fd, true);
+	else if (outcome == PAGE_UNIQUE) {
+	    if (global_dedup_flag)
+		ambiguous.push_back(order[i]);
+	    else {
+		pace_flush(fd);
+		handle_page(order[i], fd);
+	    }
+	}
+    }
+    dup_engine->finalize_local();
+    boost::uint64_t dedup_local_end = ckpt_stats::now_ns();
+    ckpt_stats::count(ckpt_stats::DEDUP_LOCAL_NS, dedup_local_end - dedup_start);
+    if (global_dedup_flag) {
+	// pages urgently flushed in the meantime are simply kept, a redundant copy is harmless
+	dup_engine->global_dedup();
+	ckpt_stats::count(ckpt_stats::DEDUP_GLOBAL_NS, ckpt_stats::now_ns() - dedup_local_end);
+	for (unsigned int i = 0; i < ambiguous.size(); i++) {
+	    boost::this_thread::interruption_point();
+	    flush_urgent(fd);
+	    bool duplicate = !dup_engine->check_page(ambiguous[i]);
+	    if (!duplicate)
+		pace_flush(fd);
+	    handle_page(ambiguous[i], fd, duplicate);
+	}
+    }
+    const stats_t &dup_stats = dup_engine->get_local_stats();
+    ckpt_stats::set_dedup(dup_stats.total, dup_stats.local, dup_stats.global);
+    if (dedup_report_flag) {
+	std::string report = dup_engine->get_stats();
+	if (report != "")
+	    DBG("DEDUP statistics: " << report);
+    }
 }
 
 static bool no_order_comparator(const region_manager::touched_entry_t &e1, 
@@ -284,19 +1253,395 @@ static bool no_order_comparator(const region_manager::touched_entry_t &e1,
     return e1.first < e2.first;
 }
 
+// touched is in fault order, a stable sort keeps it within each access type
 static bool order_comparator(const region_manager::touched_entry_t &e1, 
 			     const region_manager::touched_entry_t &e2) {
-    if (e1.second < e2.second)
-	return true;
-    if (e1.second > e2.second)
+    return e1.second < e2.second;
+}
+
+void region_manager::pace_flush(int fd) {
+    if (governor == NULL)
+	return;
+    boost::uint64_t wait_us;
+    while ((wait_us = governor->delay(page_size)) > 0) {
+	// blocked threads are not paced, keep serving them in between short naps
+	flush_urgent(fd);
+	boost::this_thread::sleep(boost::posix_time::microseconds(std::min(wait_us, (boost::uint64_t)1000)));
+    }
+}
+
+void region_manager::wait_for_admission(int fd) {
+    // until this rank's wave is admitted the application keeps writing into COW copies,
+    // only threads blocked on a page get it flushed
+    while (!stagger->admitted()) {
+	boost::this_thread::interruption_point();
+	flush_urgent(fd);
+	boost::this_thread::sleep(boost::posix_time::microseconds(200));
+    }
+}
+
+void region_manager::flush_urgent(int fd) {
+    while (1) {
+	char *addr;
+	{
+	    boost::mutex::scoped_lock lock(page_lock);
+	    if (urgent_head == urgent_tail)
+		return;
+	    addr = urgent[urgent_head++ % URGENT_RING];
+	}
+	handle_page(addr, fd);
+	stats_urgent++;
+	// the faulting thread is likely to continue with the neighbouring pages
+	for (unsigned int i = 1; i <= urgent_window; i++)
+	    handle_page(addr + i * page_size, fd);
+    }
+}
+
+static bool learned_order_comparator(const std::pair<float, char *> &e1,
+				     const std::pair<float, char *> &e2) {
+    // touched is flushed back to front: earliest predicted writes go last, unknown ones first
+    if (e1.first < 0 || e2.first < 0)
+	return e1.first < 0 && e2.first >= 0;
+    return e1.first > e2.first;
+}
+
+void region_manager::learn_order() {
+    boost::mutex::scoped_lock lock(page_lock);
+
+    // forget the address ranks of the previous flush set
+    for (touched_t::iterator t_it = touched.begin(); t_it != touched.end(); t_it++) {
+	page_map_t::iterator p_it = pages.find(t_it->first);
+	if (p_it != pages.end())
+	    p_it->second.addr_rank = NO_RANK;
+    }
+    // new_touched holds the first writes of the last epoch in fault order
+    float n = new_touched.size();
+    for (unsigned int i = 0; i < new_touched.size(); i++) {
+	page_map_t::iterator p_it = pages.find(new_touched[i].first);
+	if (p_it == pages.end())
+	    continue;
+	float rank = i / n;
+	if (p_it->second.order_hint < 0)
+	    p_it->second.order_hint = rank;
+	else
+	    p_it->second.order_hint = ORDER_HINT_WEIGHT * rank +
+		(1 - ORDER_HINT_WEIGHT) * p_it->second.order_hint;
+    }
+}
+
+void region_manager::apply_learned_order() {
+    std::vector<std::pair<float, char *> > order;
+
+    std::sort(touched.begin(), touched.end(), &no_order_comparator);
+    order.reserve(touched.size());
+    {
+	boost::mutex::scoped_lock lock(page_lock);
+	// address order is flushed back to front as well
+	for (int i = touched.size() - 1; i >= 0; i--) {
+	    page_map_t::iterator p_it = pages.find(touched[i].first);
+	    if (p_it == pages.end())
+		continue;
+	    p_it->second.addr_rank = order.size();
+	    order.push_back(std::make_pair(p_it->second.order_hint, p_it->first));
+	}
+    }
+    std::stable_sort(order.begin(), order.end(), &learned_order_comparator);
+    touched.clear();
+    for (unsigned int i = 0; i < order.size(); i++)
+	touched.push_back(touched_entry_t(order[i].second, PAGE_AFTER));
+}
+
+std::string region_manager::ckpt_file_name(const std::string &prefix, const std::string &kind, unsigned int seq, int rank) {
+    std::ostringstream ss;
+    ss << prefix << "/blobcr-" << kind << "-";
+    if (group_name != "")
+	ss << group_name << "-";
+    ss << (rank < 0 ? mpi_comm_world.rank() : rank) << "-" << seq << ".dat";
+    return ss.str();
+}
+
+void region_manager::write_references(unsigned int seq) {
+    std::vector<dedup_ref_t> refs;
+
+    // owners are asked from the writer, which needs MPI_THREAD_MULTIPLE like the pipelined pass
+    bool global = global_dedup_flag &&
+	boost::mpi::environment::thread_level() == boost::mpi::threading::multiple;
+    dup_engine->resolve_references(page_offsets, page_positions, global, refs);
+    page_offsets.clear();
+    page_positions.clear();
+    // small and needed by every rank on restart, so it goes straight to the durable prefix
+    std::string name = ckpt_file_name(ckpt_path_prefix, "refs", seq);
+    int fd = open(name.c_str(), O_WRONLY | O_TRUNC | O_CREAT, 0666);
+    if (fd == -1) {
+	ERROR("cannot create dedup reference file " << name);
+	return;
+    }
+    size_t size = refs.size() * sizeof(dedup_ref_t), progress = 0;
+    while (progress < size) {
+	ssize_t result = write(fd, (char *)refs.data() + progress, size - progress);
+	ASSERT(result != -1);
+	progress += result;
+    }
+    close(fd);
+}
+
+// the image without dedup is the checkpoint file with the referenced pages put back at their
+// flush positions; shared pages are read once per node, spread over its ranks, and exchanged
+// among them
+bool region_manager::restore_deduplicated(int seq, const std::string &file_name) {
+    typedef std::pair<boost::uint32_t, boost::uint64_t> location_t;
+    std::vector<location_t> wanted;
+    std::vector<boost::uint64_t> positions;
+    bool ok = dedup_flag && shared == NULL;
+
+    wait_for_completion();
+    if (ok) {
+	std::string name = ckpt_file_name(ckpt_path_prefix, "refs", seq);
+	int fd = open(name.c_str(), O_RDONLY);
+	if (fd == -1)
+	    ok = false;
+	else {
+	    dedup_ref_t ref;
+	    while (read(fd, &ref, sizeof(ref)) == sizeof(ref)) {
+		if (ref.offset == DEDUP_NO_OFFSET || ref.position == DEDUP_NO_OFFSET)
+		    ok = false;
+		wanted.push_back(location_t(ref.owner, ref.offset));
+		positions.push_back(ref.position);
+	    }
+	    close(fd);
+	}
+    }
+    if (!ok)
+	wanted.clear();
+
+    MPI_Comm node;
+    MPI_Comm_split_type(mpi_comm_world, MPI_COMM_TYPE_SHARED, mpi_comm_world.rank(), MPI_INFO_NULL, &node);
+    boost::mpi::communicator node_comm(node, boost::mpi::comm_take_ownership);
+    std::vector<std::vector<location_t> > node_wanted;
+    boost::mpi::all_gather(node_comm, wanted, node_wanted);
+    std::vector<location_t> fetch;
+    for (unsigned int i = 0; i < node_wanted.size(); i++)
+	fetch.insert(fetch.end(), node_wanted[i].begin(), node_wanted[i].end());
+    std::sort(fetch.begin(), fetch.end());
+    fetch.erase(std::unique(fetch.begin(), fetch.end()), fetch.end());
+
+    // the i-th distinct page is read by node rank i % size
+    unsigned int node_rank = node_comm.rank(), node_size = node_comm.size();
+    std::map<location_t, std::string> fetched;
+    std::map<boost::uint32_t, int> owner_fds;
+    bool fetch_ok = true;
+    for (unsigned int i = node_rank; i < fetch.size(); i += node_size) {
+	std::map<boost::uint32_t, int>::iterator f_it = owner_fds.find(fetch[i].first);
+	if (f_it == owner_fds.end()) {
+	    std::string name = ckpt_file_name(ckpt_path_prefix, "ckpt", seq, fetch[i].first);
+	    f_it = owner_fds.insert(std::make_pair(fetch[i].first, open(name.c_str(), O_RDONLY))).first;
+	}
+	std::string &page = fetched[fetch[i]];
+	page.resize(page_size);
+	if (f_it->second == -1 || pread(f_it->second, &page[0], page_size, fetch[i].second) != (ssize_t)page_size)
+	    fetch_ok = false;
+    }
+    for (std::map<boost::uint32_t, int>::iterator f_it = owner_fds.begin(); f_it != owner_fds.end(); f_it++)
+	if (f_it->second != -1)
+	    close(f_it->second);
+    // a page missing on one rank leaves a hole in what it hands to the others
+    fetch_ok = boost::mpi::all_reduce(node_comm, fetch_ok, std::logical_and<bool>());
+
+    std::vector<std::string> out(node_size), in;
+    for (unsigned int r = 0; r < node_size; r++)
+	for (unsigned int i = 0; i < node_wanted[r].size(); i++) {
+	    std::map<location_t, std::string>::iterator p_it = fetched.find(node_wanted[r][i]);
+	    if (p_it != fetched.end())
+		out[r] += p_it->second;
+	}
+    boost::mpi::all_to_all(node_comm, out, in);
+    if (!ok || !fetch_ok)
 	return false;
-    return e1.first < e2.first;
+
+    // where the content of each reference arrived, then the references in image order
+    std::vector<size_t> next(node_size, 0);
+    std::vector<std::pair<boost::uint64_t, const char *> > placed(wanted.size());
+    for (unsigned int i = 0; i < wanted.size(); i++) {
+	unsigned int from = (std::lower_bound(fetch.begin(), fetch.end(), wanted[i]) - fetch.begin()) % node_size;
+	placed[i] = std::make_pair(positions[i], in[from].data() + next[from]);
+	next[from] += page_size;
+    }
+    std::sort(placed.begin(), placed.end());
+
+    int src = open(ckpt_file_name(ckpt_path_prefix, "ckpt", seq).c_str(), O_RDONLY);
+    int dst = open(file_name.c_str(), O_WRONLY | O_TRUNC | O_CREAT, 0666);
+    struct stat st;
+    if (src == -1 || dst == -1 || fstat(src, &st) == -1) {
+	if (src != -1)
+	    close(src);
+	if (dst != -1)
+	    close(dst);
+	return false;
+    }
+    // the written pages fill the positions in between, in file order
+    boost::uint64_t total = st.st_size / page_size + placed.size();
+    std::vector<char> buff(page_size);
+    unsigned int r = 0;
+    for (boost::uint64_t pos = 0; pos < total; pos++) {
+	const char *page = &buff[0];
+	if (r < placed.size() && placed[r].first == pos)
+	    page = placed[r++].second;
+	else if (read(src, &buff[0], page_size) != (ssize_t)page_size) {
+	    ok = false;
+	    break;
+	}
+	if (write(dst, page, page_size) != (ssize_t)page_size) {
+	    ok = false;
+	    break;
+	}
+    }
+    // positions beyond the image, or twice the same one
+    ok = ok && r == placed.size();
+    close(src);
+    close(dst);
+    return ok;
+}
+
+void region_manager::flush_checkpoint(const std::string &local_name) {
+    int fd;
+
+    if (learned_order_flag)
+	apply_learned_order();
+    else if (incremental_flag) {
+	if (access_order_flag) 
+	    std::stable_sort(touched.begin(), touched.end(), &order_comparator);
+	else 
+	    std::sort(touched.begin(), touched.end(), &no_order_comparator);
+    }
+		    
+    // now write the checkpointing data
+    if (shared != NULL) {
+	std::ostringstream ss;
+	ss << ckpt_path_prefix << "/blobcr-shared-" << shared->get_group_id() << "-" << seq_no;
+	shared->begin(ss.str() + ".dat", ss.str() + ".idx", (boost::uint64_t)no_scheduled * page_size);
+	fd = -1;
+    } else {
+	fd = open(local_name.c_str(), O_RDWR | O_TRUNC | O_CREAT, 0666);
+	ASSERT(fd != -1);
+	flush_offset = 0;
+	flush_position = 0;
+	page_offsets.clear();
+	page_positions.clear();
+    }
+    if (partner != NULL)
+	partner->begin(seq_no);
+    if (coder != NULL)
+	coder->begin(ckpt_file_name(drainer != NULL ? ckpt_local_prefix : ckpt_path_prefix, "parity", seq_no),
+		     (boost::uint64_t)no_scheduled * page_size);
+
+    // the global dedup pass is a collective among the writers, which cannot wait for each other
+    bool staggered = stagger != NULL && !dedup_pipelined;
+    if (staggered) {
+	stagger->begin();
+	wait_for_admission(fd);
+    }
+    if (governor != NULL)
+	governor->begin();
+    std::vector<char *> order;
+    if (incremental_flag || access_order_flag || learned_order_flag)
+	for (int i = touched.size() - 1; i >= 0; i--)
+	    order.push_back(touched[i].first);
+    if (!incremental_flag)
+	for (page_map_t::iterator p_it = pages.begin(); p_it != pages.end(); p_it++)
+	    order.push_back(p_it->first);
+    if (dedup_pipelined)
+	flush_deduplicated(order, fd);
+    else if (numa_nodes > 1 && partner == NULL && coder == NULL && shared == NULL && governor == NULL)
+	flush_by_node(order, fd);
+    else
+	for (unsigned int i = 0; i < order.size(); i++) {
+	    boost::this_thread::interruption_point();
+	    flush_urgent(fd);
+	    pace_flush(fd);
+	    handle_page(order[i], fd);
+	}
+		
+    flush_urgent(fd);
+    if (staggered)
+	stagger->finish(flush_offset);
+    if (shared != NULL)
+	shared->finish();
+    else
+	close(fd);
+    if (coder != NULL && !coder->finish())
+	ERROR("parity of checkpoint " << seq_no << " is incomplete, it cannot be used for a rebuild");
+    // committed only once the buddy holds its copy as well
+    if (partner != NULL && !partner->finish())
+	ERROR("buddy " << partner->get_buddy() << " holds no complete copy of checkpoint " << seq_no);
+    // pages left out by dedup are only restorable through where their content went
+    if (dedup_flag && shared == NULL)
+	write_references(seq_no);
+}
+
+// the writers only fan out when nothing else consumes the pages in flush order
+void region_manager::flush_by_node(const std::vector<char *> &order, int fd) {
+    std::vector<int> status(order.size());
+    std::vector<char *> local;
+
+    numa_policy::nodes_of((char **)order.data(), order.size(), status.data());
+    {
+	boost::mutex::scoped_lock lock(work_lock);
+	for (unsigned int i = 1; i < numa_nodes; i++)
+	    node_pages[i].clear();
+	// pages on node 0, and pages not backed yet, stay with this thread
+	for (unsigned int i = 0; i < order.size(); i++)
+	    if (status[i] > 0 && (unsigned int)status[i] < numa_nodes)
+		node_pages[status[i]].push_back(order[i]);
+	    else
+		local.push_back(order[i]);
+	node_fd = fd;
+	node_busy = numa_nodes - 1;
+	node_epoch++;
+	node_cond.notify_all();
+    }
+    numa_policy::pin_thread(0);
+    for (unsigned int i = 0; i < local.size(); i++) {
+	boost::this_thread::interruption_point();
+	flush_urgent(fd);
+	handle_page(local[i], fd);
+    }
+    while (1) {
+	{
+	    boost::mutex::scoped_lock lock(work_lock);
+	    if (node_busy == 0)
+		break;
+	    node_cond.timed_wait(lock, boost::posix_time::milliseconds(1));
+	}
+	flush_urgent(fd);
+    }
+}
+
+void region_manager::node_writer_exec(unsigned int node) {
+    unsigned int epoch = 0;
+
+    numa_policy::pin_thread(node);
+    while (1) {
+	{
+	    boost::mutex::scoped_lock lock(work_lock);
+	    while (node_epoch == epoch)
+		node_cond.wait(lock);
+	    epoch = node_epoch;
+	}
+	std::vector<char *> &order = node_pages[node];
+	for (unsigned int i = 0; i < order.size(); i++) {
+	    boost::this_thread::interruption_point();
+	    handle_page(order[i], node_fd);
+	}
+	{
+	    boost::mutex::scoped_lock lock(work_lock);
+	    node_busy--;
+	    node_cond.notify_all();
+	}
+    }
 }
 
 void region_manager::async_io_exec() {
-    std::stringstream ss;
     std::string local_name;
-    int fd;
 
     while (1) {
 	{
@@ -306,36 +1651,31 @@ void region_manager::async_io_exec() {
 		work_cond.wait(lock);
 	}
 	
-	if (incremental_flag) {
-	    if (access_order_flag) 
-		std::sort(touched.begin(), touched.end(), &order_comparator);
-	    else 
-		std::sort(touched.begin(), touched.end(), &no_order_comparator);
+	// with a local tier, complete there and let the drainer reach the durable prefix
+	std::string prefix = drainer != NULL ? ckpt_local_prefix : ckpt_path_prefix;
+	local_name = ckpt_file_name(prefix, "ckpt", seq_no);
+	bool written = true;
+	if (fork_flag)
+	    written = wait_snapshot();
+	else
+	    flush_checkpoint(local_name);
+	if (drainer != NULL && written)
+	    drainer->submit(seq_no, local_name, ckpt_file_name(ckpt_path_prefix, "ckpt", seq_no));
+	if (scheduler != NULL)
+	    scheduler->completed(ckpt_stats::now_ns(), no_blocks);
+	if (trace != NULL) {
+	    trace->record(ckpt_trace::CKPT_END, 0, NULL, no_blocks, ckpt_stats::now_ns());
+	    trace->dump();
 	}
-		    
-	// now write the checkpointing data
-	ss.str("");
-	ss << ckpt_path_prefix << "/blobcr-ckpt-" << mpi_comm_world.rank() << "-" << seq_no << ".dat";
-	local_name = ss.str();
-
-	fd = open(local_name.c_str(), O_RDWR | O_TRUNC | O_CREAT, 0666);
-	ASSERT(fd != -1);
-
-	if (incremental_flag || access_order_flag)
-	    for (int i = touched.size() - 1; i >= 0; i--) {
-		boost::this_thread::interruption_point();
-		handle_page(touched[i].first, fd);
-	    }
-	if (!incremental_flag)
-	    for (page_map_t::iterator p_it = pages.begin(); p_it != pages.end(); p_it++) {
-		boost::this_thread::interruption_point();
-		handle_page(p_it->first, fd);
-	    }
-		
-	close(fd);
 	INFO("CHECKPOINT COMPLETE - " << construct_stats());
-	seq_no++;
-	checkpoint_in_progress = false;
-	work_cond.notify_all(); 
+	// run the callback before releasing the waiters, so they observe its effects
+	if (ckpt_callback != NULL)
+	    ckpt_callback(seq_no, ckpt_callback_arg);
+	{
+	    boost::mutex::scoped_lock lock(work_lock);
+	    seq_no++;
+	    checkpoint_in_progress = false;
+	    work_cond.notify_all(); 
+	}
     }
 }
@@ -19,6 +19,10 @@
 #define __REGION_MANAGER
 
 #include <fstream>
+#include <vector>
+#include <atomic>
+
+#include <sys/types.h>
 
 #include <boost/thread.hpp>
 #include <boost/thread/mutex.hpp>
@@ -29,33 +33,96 @@
 
 #include "cow_allocator.hpp"
 #include "dedup_engine.hpp"
+#include "ckpt_drainer.hpp"
+#include "partner_replicator.hpp"
+#include "erasure_coder.hpp"
+#include "shared_writer.hpp"
+#include "flush_stagger.hpp"
+#include "ckpt_stats.hpp"
+#include "flush_governor.hpp"
+#include "numa_policy.hpp"
+#include "ckpt_scheduler.hpp"
+#include "ckpt_trace.hpp"
 
 class region_manager {
 public:
+    typedef void (*callback_t)(int id, void *arg);
     // Where to store access order
     typedef std::pair<char *, char> touched_entry_t;    
     typedef std::vector<touched_entry_t, 
 			boost::pool_allocator<touched_entry_t, no_reclaim_allocator>
 			> touched_t;
+    struct touched_log_entry_t {
+	// page address with the access type in the low bits
+	unsigned long addr_type;
+	boost::uint64_t stamp;
+    };
 private:
     // Page state
     static const char PAGE_SCHEDULED = 1, PAGE_INPROGRESS = 2, PAGE_COMMITTED = 3;
     // Page access type
     static const char PAGE_WAIT = 1, PAGE_COW = 2, PAGE_AFTER = 3, PAGE_DELAYED = 4;
+    // Outcome of fingerprinting a scheduled page during a pipelined checkpoint
+    static const char PAGE_UNIQUE = 1, PAGE_DUPLICATE = 2, PAGE_GONE = 3;
     
     boost::uint64_t page_size;
-    std::string ckpt_path_prefix;
-    boost::uint64_t cow_threshold;
-    bool incremental_flag, access_order_flag, dedup_flag, global_dedup_flag;
+    std::string ckpt_path_prefix, ckpt_local_prefix, group_name;
+    boost::uint64_t cow_threshold, spill_threshold;
+    bool incremental_flag, access_order_flag, learned_order_flag, dedup_flag, global_dedup_flag, dedup_report_flag;
+    // dedup of the current checkpoint runs on the writer, overlapped with the flush; pages
+    // are hashed from a copy taken under page_lock
+    bool dedup_pipelined;
+    std::vector<char> fingerprint_buffer;
+    // file offset of every page flushed with dedup, to point the dropped ones at their content,
+    // and the flush position of the dropped ones, to put that content back in place on restore;
+    // positions and offsets are handed out together under page_lock
+    page_offsets_t page_offsets, page_positions;
+    boost::uint64_t flush_position;
+    // full checkpoints with dedup keep tracking writes, so only pages written since their last
+    // fingerprint are hashed again; pages removed meanwhile are forgotten at the next checkpoint
+    bool fingerprint_cache_flag;
+    std::vector<char *> untracked_pages;
+    // checkpoints are written by a forked child from its copy of the address space
+    bool fork_flag;
+    pid_t snapshot_pid;
+    std::string snapshot_name;
+    std::vector<char *> snapshot_pages;
     
     touched_t touched, new_touched;
+
+    // First writes are logged per thread into preallocated rings, merged at checkpoint time;
+    // threads beyond MAX_TOUCHED_LOGS, or with a full ring, append to the preallocated overflow
+    // area under a spin lock instead. Should that fill up as well, the next checkpoint takes
+    // every page as touched.
+    static const unsigned int MAX_TOUCHED_LOGS = 64;
+    struct touched_log_t {
+	touched_log_entry_t *entries;
+	std::atomic<unsigned long> head, tail;
+    } __attribute__ ((aligned (64)));
+    touched_log_t touched_logs[MAX_TOUCHED_LOGS];
+    touched_log_entry_t *touched_log_region;
+    unsigned long touched_log_capacity;
+    touched_log_entry_t *touched_overflow;
+    unsigned long touched_overflow_size;
+    bool touched_lost;
+    std::atomic_flag touched_overflow_lock;
     
+    // Learned flush order: weight of the latest epoch in the first-write rank estimate
+    static const float ORDER_HINT_WEIGHT;
+    static const unsigned int NO_RANK = (unsigned int)-1;
+
     struct page_info_t {
 	char *cow_ptr;
+	// predicted relative first-write position in the next epoch (0 = earliest, < 0 = unknown)
+	float order_hint;
+	// position of the page in an address-ordered flush of the current set
+	unsigned int addr_rank;
 	
 	char state;
+	// a duplicate scheduled by the non-pipelined dedup, committed without being written
+	bool dropped;
 	page_info_t() : 
-	    cow_ptr(NULL), state(PAGE_COMMITTED) { }
+	    cow_ptr(NULL), order_hint(-1), addr_rank(NO_RANK), state(PAGE_COMMITTED), dropped(false) { }
     };
 
     typedef std::pair<char *, page_info_t> page_entry_t;
@@ -65,34 +132,128 @@ private:
 				 > page_map_t;
     page_map_t pages;
 
+    // pages that application threads are blocked on, served before the bulk order; a fixed ring
+    // under page_lock, as the fault handler cannot allocate (a page that does not fit is just
+    // flushed in its turn)
+    static const unsigned int URGENT_RING = 1024;
+    char *urgent[URGENT_RING];
+    unsigned int urgent_head, urgent_tail;
+    unsigned int urgent_window;
+    // most pages a confirmed fault stream handles ahead of its fault, 0 disables speculation
+    unsigned int speculate_window;
+
     boost::uint64_t total_mem_size;
-    unsigned int no_blocks, seq_no;
-    unsigned stats_page_cow, stats_page_wait, stats_page_after, stats_page_delayed;
+    // sorted, disjoint [start, end) address ranges of the tracked regions, for the lookups that
+    // cannot take page_lock (fault dispatch, prefault): copied and replaced under page_lock on every
+    // change, the replaced copies freed once no lookup is in flight
+    typedef std::vector<std::pair<unsigned long, unsigned long> > region_set_t;
+    std::atomic<region_set_t *> regions;
+    std::atomic<unsigned int> region_readers;
+    std::vector<region_set_t *> retired_regions;
+    unsigned int no_blocks, no_scheduled, seq_no;
+    unsigned stats_page_cow, stats_page_spill, stats_page_wait, stats_page_after, stats_page_delayed;
+    unsigned stats_order_faults, stats_addr_order_faults, stats_urgent;
+    boost::uint64_t stats_max_wait_us;
     bool checkpoint_in_progress;
+    callback_t ckpt_callback;
+    void *ckpt_callback_arg;
 
     boost::mutex page_lock, work_lock;
     boost::condition_variable work_cond, page_cond;
     boost::thread async_io_thread;
 
-    boost::mpi::environment mpi_env;
+    // with several NUMA nodes, a writer pinned to each further node flushes the pages it holds,
+    // all of them appending to the checkpoint file through flush_offset
+    unsigned int numa_nodes, node_epoch, node_busy;
+    int node_fd;
+    std::vector<std::vector<char *> > node_pages;
+    boost::condition_variable node_cond;
+    boost::thread_group node_writers;
+    std::atomic<boost::uint64_t> flush_offset;
+
+    // optional Young/Daly scheduling for checkpoint_if_due()
+    ckpt_scheduler *scheduler;
+
+    // one MPI environment for all region managers, finalized with the last of them
+    struct mpi_env_ref_t {
+	mpi_env_ref_t();
+	~mpi_env_ref_t();
+    } mpi_env;
+    // private duplicate of MPI_COMM_WORLD, so the collectives of different groups never match
     boost::mpi::communicator mpi_comm_world;
     dedup_engine *dup_engine;
+    ckpt_drainer *drainer;
+    partner_replicator *partner;
+    erasure_coder *coder;
+    shared_writer *shared;
+    flush_governor *governor;
+    flush_stagger *stagger;
+    ckpt_trace *trace;
     std::ofstream ckpt_log_file;
 
     void async_io_exec();
+    void flush_checkpoint(const std::string &local_name);
+    void flush_by_node(const std::vector<char *> &order, int fd);
+    void node_writer_exec(unsigned int node);
+    unsigned long dirty_pages();
+    int start_writer(callback_t callback, void *arg);
+    int snapshot_async();
+    bool wait_snapshot();
+    std::string ckpt_file_name(const std::string &prefix, const std::string &kind, unsigned int seq, int rank = -1);
+    void write_references(unsigned int seq);
     std::string construct_stats();
-    void handle_page(char *addr, int fd);
+    void handle_page(char *addr, int fd, bool discard = false);
+    void update_regions(unsigned long start, unsigned long end, bool add);
+    char fingerprint_page(char *addr);
+    void flush_deduplicated(const std::vector<char *> &order, int fd);
+    void flush_urgent(int fd);
+    void pace_flush(int fd);
+    void wait_for_admission(int fd);
+    void log_touched(char *addr, char access_type, boost::uint64_t stamp);
+    void speculate(char *buff, boost::uint64_t stamp);
+    void collect_touched();
+    void learn_order();
+    void apply_learned_order();
     
 public:
     region_manager(boost::uint64_t page_size, std::string &ckpt_path_prefix, std::string &ckpt_log_prefix,
-		   boost::uint64_t cow_mem, bool inc_flag, bool aorder_flag, bool dup_flag, bool global_dup_flag);
+		   boost::uint64_t cow_mem, bool inc_flag, bool aorder_flag, bool lorder_flag,
+		   bool dup_flag, bool global_dup_flag);
     ~region_manager();
 
+    void set_touched_log_size(unsigned long entries);
+    void set_group_name(const std::string &name);
+    void set_urgent_window(unsigned int window);
+    void set_speculation(unsigned int max_window);
+    void set_dedup_report(bool flag);
+    void set_flush_bandwidth(boost::uint64_t bandwidth, bool adaptive);
+    bool enable_fork_snapshot();
+    bool enable_numa();
+    bool enable_hierarchical_dedup();
+    bool enable_trace(const std::string &trace_dir, unsigned long entries);
+    void enable_scheduler(double mtbf);
+    bool enable_spill(const std::string &spill_dir, boost::uint64_t spill_mem);
+    bool enable_stagger(unsigned int wave, double fs_bandwidth);
+    bool enable_shared_file(unsigned int group_size, unsigned int aggregators);
+    bool enable_erasure_coding(int group_size, int parity);
+    bool enable_partner_copy(const std::string &store_prefix, boost::uint64_t mem_limit);
+    void enable_local_tier(const std::string &local_prefix, boost::uint64_t capacity, boost::uint64_t bandwidth);
     bool add_region(const void *buff, boost::uint64_t size);
     boost::uint64_t remove_region(const void *buff, 
 				  boost::uint64_t size = 0);
     bool checkpoint();
+    int checkpoint_async(callback_t callback = NULL, void *arg = NULL);
+    int checkpoint_if_due(callback_t callback = NULL, void *arg = NULL);
+    bool checkpoint_test(int id);
+    void checkpoint_wait(int id);
     void wait_for_completion();
+    int get_drained_checkpoint();
+    void wait_for_drain();
+    bool restore_partner_copy(int seq, const std::string &file_name);
+    bool restore_deduplicated(int seq, const std::string &file_name);
+    bool rebuild_erasure_coded(int seq);
+    bool tracks(void *addr);
+    void prefault(void *buff, size_t size);
     bool handle_segfault(void *addr);
     void display_stats();
 };
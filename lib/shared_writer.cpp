@@ -0,0 +1,102 @@
+/*******************************************************************************
+ Author: Bogdan Nicolae
+ Copyright (C) 2013 IBM Corp.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*******************************************************************************/
+
+#include "shared_writer.hpp"
+
+#include <cstring>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+
+//#define __DEBUG
+#include "common/debug.hpp"
+
+shared_writer::shared_writer(const boost::mpi::communicator &world, unsigned int group_size,
+			     unsigned int aggr, boost::uint64_t cs) :
+    aggregators(aggr), chunk_size(cs), fh(MPI_FILE_NULL), buffer(cs), fill(0), base_offset(0),
+    written(0), rounds(0), rounds_done(0) {
+    world_rank = world.rank();
+    group_id = group_size == 0 ? 0 : world.rank() / group_size;
+    group = world.split(group_id, world.rank());
+}
+
+void shared_writer::begin(const std::string &file_name, const std::string &iname, boost::uint64_t reserved) {
+    boost::uint64_t max_reserved, offset = 0;
+
+    MPI_Exscan(&reserved, &offset, 1, MPI_UINT64_T, MPI_SUM, group);
+    base_offset = group.rank() == 0 ? 0 : offset;
+    // collective writes need the same number of calls everywhere
+    boost::mpi::all_reduce(group, reserved, max_reserved, boost::mpi::maximum<boost::uint64_t>());
+    rounds = (max_reserved + chunk_size - 1) / chunk_size;
+    rounds_done = 0;
+    written = 0;
+    fill = 0;
+    index_name = iname;
+
+    MPI_Info info;
+    MPI_Info_create(&info);
+    // two-phase aggregation onto a subset of the ranks
+    MPI_Info_set(info, (char *)"romio_cb_write", (char *)"enable");
+    if (aggregators > 0) {
+	std::ostringstream ss;
+	ss << aggregators;
+	MPI_Info_set(info, (char *)"cb_nodes", (char *)ss.str().c_str());
+    }
+    int ret = MPI_File_open(group, (char *)file_name.c_str(), MPI_MODE_WRONLY | MPI_MODE_CREATE, info, &fh);
+    MPI_Info_free(&info);
+    ASSERT(ret == MPI_SUCCESS);
+    MPI_File_set_size(fh, 0);
+}
+
+void shared_writer::write_round() {
+    ASSERT(rounds_done < rounds);
+    int ret = MPI_File_write_at_all(fh, base_offset + written, &buffer[0], fill, MPI_BYTE, MPI_STATUS_IGNORE);
+    ASSERT(ret == MPI_SUCCESS);
+    written += fill;
+    fill = 0;
+    rounds_done++;
+}
+
+void shared_writer::push(const char *buff, boost::uint64_t size) {
+    while (size > 0) {
+	boost::uint64_t len = std::min(size, chunk_size - fill);
+	memcpy(&buffer[fill], buff, len);
+	fill += len;
+	buff += len;
+	size -= len;
+	if (fill == chunk_size)
+	    write_round();
+    }
+}
+
+void shared_writer::finish() {
+    while (rounds_done < rounds)
+	write_round();
+    ASSERT(fill == 0);
+    MPI_File_close(&fh);
+
+    // global index: one (rank, offset, length) record per member
+    boost::uint64_t entry[3] = {(boost::uint64_t)world_rank, base_offset, written};
+    std::vector<boost::uint64_t> index(group.rank() == 0 ? 3 * group.size() : 0);
+    MPI_Gather(entry, 3, MPI_UINT64_T, group.rank() == 0 ? &index[0] : NULL, 3, MPI_UINT64_T, 0, group);
+    if (group.rank() == 0) {
+	std::ofstream f(index_name.c_str(), std::ios::binary | std::ios::trunc);
+	f.write((const char *)&index[0], index.size() * sizeof(boost::uint64_t));
+	if (!f.good())
+	    ERROR("could not write checkpoint index " << index_name);
+    }
+}
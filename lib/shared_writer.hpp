@@ -0,0 +1,52 @@
+/*******************************************************************************
+ Author: Bogdan Nicolae
+ Copyright (C) 2013 IBM Corp.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*******************************************************************************/
+
+#ifndef __SHARED_WRITER
+#define __SHARED_WRITER
+
+#include <string>
+#include <vector>
+
+#include <boost/mpi.hpp>
+
+// Writes the page streams of an I/O group into a single file with collective MPI-IO;
+// every rank owns the extent given by an exscan over the reserved sizes
+class shared_writer {
+private:
+    boost::mpi::communicator group;
+    int group_id, world_rank;
+    unsigned int aggregators;
+    boost::uint64_t chunk_size;
+
+    MPI_File fh;
+    std::vector<char> buffer;
+    boost::uint64_t fill, base_offset, written, rounds, rounds_done;
+    std::string index_name;
+
+    void write_round();
+
+public:
+    shared_writer(const boost::mpi::communicator &world, unsigned int group_size,
+		  unsigned int aggregators, boost::uint64_t chunk_size);
+
+    int get_group_id() { return group_id; }
+    void begin(const std::string &file_name, const std::string &index_name, boost::uint64_t reserved);
+    void push(const char *buff, boost::uint64_t size);
+    void finish();
+};
+
+#endif
@@ -15,19 +15,74 @@
  limitations under the License.
 *******************************************************************************/
 
+#define _GNU_SOURCE
+
+#include <stdio.h>
 #include <unistd.h>
-#include <string.h>
+#include <dlfcn.h>
 #include <sys/syscall.h>
+#include <sys/socket.h>
 #include <sys/uio.h>
 
+// Protected pages written by the kernel fail with EFAULT instead of faulting, so the tracked
+// pages of every destination buffer are touched once from user space before the call.
+void prefault_protected(void *buff, size_t size);
+
+static void prefault_iov(const struct iovec *iov, int iovcnt) {
+    int i;
+    for (i = 0; i < iovcnt; i++)
+	prefault_protected(iov[i].iov_base, iov[i].iov_len);
+}
+
 ssize_t read(int fd, void *buf, size_t size) {
-    memset(buf, 0, size);
+    prefault_protected(buf, size);
     return syscall(SYS_read, fd, buf, size);
 }
 
 ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
-    int i;
-    for (i = 0; i < iovcnt; i++)
-	memset(iov[i].iov_base, 0, iov[i].iov_len);
+    prefault_iov(iov, iovcnt);
     return syscall(SYS_readv, fd, iov, iovcnt);
 }
+
+ssize_t pread(int fd, void *buf, size_t size, off_t offset) {
+    prefault_protected(buf, size);
+    return syscall(SYS_pread64, fd, buf, size, offset);
+}
+
+ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+    prefault_iov(iov, iovcnt);
+    // the kernel takes the offset split in two longs
+    return syscall(SYS_preadv, fd, iov, iovcnt, (long)offset, (long)((unsigned long long)offset >> 32));
+}
+
+// large file variants, which is what pread and preadv resolve to with _FILE_OFFSET_BITS=64
+ssize_t pread64(int fd, void *buf, size_t size, off64_t offset) {
+    prefault_protected(buf, size);
+    return syscall(SYS_pread64, fd, buf, size, offset);
+}
+
+ssize_t preadv64(int fd, const struct iovec *iov, int iovcnt, off64_t offset) {
+    prefault_iov(iov, iovcnt);
+    return syscall(SYS_preadv, fd, iov, iovcnt, (long)offset, (long)((unsigned long long)offset >> 32));
+}
+
+ssize_t recv(int fd, void *buf, size_t size, int flags) {
+    prefault_protected(buf, size);
+    return syscall(SYS_recvfrom, fd, buf, size, flags, NULL, NULL);
+}
+
+ssize_t recvmsg(int fd, struct msghdr *msg, int flags) {
+    prefault_iov(msg->msg_iov, msg->msg_iovlen);
+    prefault_protected(msg->msg_name, msg->msg_namelen);
+    prefault_protected(msg->msg_control, msg->msg_controllen);
+    return syscall(SYS_recvmsg, fd, msg, flags);
+}
+
+// stdio reads large requests straight into the buffer through internal calls that bypass read()
+size_t fread(void *buf, size_t size, size_t count, FILE *stream) {
+    static size_t (*libc_fread)(void *, size_t, size_t, FILE *) = NULL;
+    if (libc_fread == NULL)
+	libc_fread = (size_t (*)(void *, size_t, size_t, FILE *))dlsym(RTLD_NEXT, "fread");
+    prefault_protected(buf, size * count);
+    return libc_fread(buf, size, count, stream);
+}
@@ -4,6 +4,7 @@
 #include <cstring>
 #include <stdlib.h>
 #include <unistd.h>
+#include <vector>
 
 using namespace std;
 
@@ -33,6 +34,21 @@ int main(int argc, char **argv) {
 	}
     if (i == size)
 	cout << "OK!" << endl;
+
+    cout << "Testing a protected container larger than a heap arena...";
+    {
+	// twice the default CKPT_HEAP_ARENA_SIZE, served by a mapping of its own
+	vector<char, protected_allocator<char> > large(size * 2, 'C');
+	checkpoint();
+	memset(&large[0], 'D', large.size());
+	for (i = 0; i < large.size(); i++)
+	    if (large[i] != 'D') {
+		cout << "FAILED at offset: " << i << endl;
+		break;
+	    }
+	if (i == large.size())
+	    cout << "OK!" << endl;
+    }
     sleep(5);
     terminate_checkpointer();
     return 0;
@@ -2,10 +2,12 @@
 
 #include <iostream>
 #include <cstdio>
+#include <cstdlib>
 
 #include "common/debug.hpp"
 
 unsigned page_size;
+bool auto_schedule;
 
 void perform_test(char *desc, unsigned int *order, char *buff, long unsigned size) {
     std::cout << "Starting " << desc << " access test..." << std::endl;
@@ -16,7 +18,10 @@ void perform_test(char *desc, unsigned int *order, char *buff, long unsigned siz
                 buff[order[j] * page_size + k]++;
             //usleep(1);
         }
-        if (i % 10 == 0)
+        // with CKPT_MTBF the checkpointer picks the interval
+        if (auto_schedule)
+            checkpoint_if_due(NULL, NULL);
+        else if (i % 10 == 0)
             checkpoint();
         std::cout << ".";
         std::cout.flush();
@@ -33,6 +38,7 @@ int main(int argc, char *argv[]) {
         size = 1 << 30;
 
     page_size = getpagesize();
+    auto_schedule = getenv("CKPT_MTBF") != NULL;
     order = (unsigned *)malloc(size * sizeof(unsigned) / page_size);
     
     start_checkpointer();
@@ -53,6 +59,7 @@ int main(int argc, char *argv[]) {
         order[i] = (size / page_size) - i - 1;
     perform_test((char *)"descending", order, buff, size);
 
+    wait_for_checkpoint();
     terminate_checkpointer();
     
     return 0;
@@ -0,0 +1,442 @@
+#include "lib/ac_fte.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <boost/thread.hpp>
+#include <boost/thread/barrier.hpp>
+
+extern "C" {
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+}
+
+#include "common/debug.hpp"
+
+// Every configuration of the matrix runs in a forked child, once untracked as the baseline
+// and once under the checkpointer configured through the environment, because the MPI
+// environment owned by the checkpointer cannot be initialized twice in the same process.
+// Run it directly, not through mpirun.
+
+enum pattern_t {
+    SEQUENTIAL, STRIDED, INTERLEAVED, RANDOM, HOTCOLD, STENCIL, PATTERN_TYPES
+};
+
+static const char *pattern_names[PATTERN_TYPES] = {
+    "sequential", "strided", "interleaved", "random", "hotcold", "stencil"
+};
+
+static const char *fault_names[ACFTE_FAULT_TYPES] = {
+    "wait", "cow", "spill", "after", "delayed"
+};
+
+// checkpoint_if_due() at every iteration instead of a fixed interval
+static const unsigned int AUTO_INTERVAL = (unsigned int)-1;
+
+struct config_t {
+    size_t page_size, size, touch;
+    unsigned int iterations, stride, hot_percent;
+    int pattern;
+    unsigned int threads, interval;
+    std::string flags;
+};
+
+struct result_t {
+    unsigned long long run_ns, ckpt_ns, checkpoints;
+    // page faults resolved by the kernel, which is where fork snapshots pay for copy-on-write
+    unsigned long long minor_faults;
+    struct acfte_stats stats;
+};
+
+static unsigned long long minor_faults() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+static unsigned long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void split(const std::string &str, char sep, std::vector<std::string> &out) {
+    std::istringstream ss(str);
+    std::string item;
+    while (std::getline(ss, item, sep))
+	if (item != "")
+	    out.push_back(item);
+}
+
+static void generate_order(const config_t &cfg, unsigned int seed, size_t n, std::vector<size_t> &order) {
+    order.clear();
+    order.reserve(n);
+    switch (cfg.pattern) {
+    case STRIDED:
+	for (size_t off = 0; off < cfg.stride; off++)
+	    for (size_t i = off; i < n; i += cfg.stride)
+		order.push_back(i);
+	break;
+    case INTERLEAVED:
+	// two strided sweeps one page apart, the second one stride behind the first, so that
+	// each fault also falls within reach of the other stream
+	for (size_t off = 0; off < cfg.stride; off += 2)
+	    for (size_t i = off; i < n + cfg.stride; i += cfg.stride) {
+		if (i < n)
+		    order.push_back(i);
+		if (off + 1 < cfg.stride && i >= cfg.stride && i + 1 - cfg.stride < n)
+		    order.push_back(i + 1 - cfg.stride);
+	    }
+	break;
+    case RANDOM:
+	for (size_t i = 0; i < n; i++)
+	    order.push_back(i);
+	for (size_t i = n - 1; i > 0; i--)
+	    std::swap(order[i], order[rand_r(&seed) % (i + 1)]);
+	break;
+    case HOTCOLD: {
+	// hot_percent of the pages receive (100 - hot_percent) percent of the writes
+	size_t hot = std::max<size_t>(1, n * cfg.hot_percent / 100);
+	for (size_t i = 0; i < n; i++)
+	    if ((unsigned int)rand_r(&seed) % 100 < 100 - cfg.hot_percent || hot == n)
+		order.push_back(rand_r(&seed) % hot);
+	    else
+		order.push_back(hot + rand_r(&seed) % (n - hot));
+	break;
+    }
+    default:
+	for (size_t i = 0; i < n; i++)
+	    order.push_back(i);
+    }
+}
+
+static void apply_pattern(const config_t &cfg, char *slice, size_t n, const std::vector<size_t> &order) {
+    if (cfg.pattern == STENCIL)
+	// 3-point update on the leading bytes of every page, reading both neighbours
+	for (size_t i = 0; i < n; i++) {
+	    char *p = slice + i * cfg.page_size;
+	    char left = i > 0 ? p[-cfg.page_size] : 0;
+	    char right = i + 1 < n ? p[cfg.page_size] : 0;
+	    for (size_t k = 0; k < cfg.touch; k++)
+		p[k] = (p[k] + left + right) / 3 + 1;
+	}
+    else
+	for (size_t i = 0; i < order.size(); i++) {
+	    char *p = slice + order[i] * cfg.page_size;
+	    for (size_t k = 0; k < cfg.touch; k++)
+		p[k]++;
+	}
+}
+
+static void worker(const config_t &cfg, char *slice, size_t n, unsigned int id, boost::barrier &bar) {
+    std::vector<size_t> order;
+    generate_order(cfg, id + 1, n, order);
+    for (unsigned int it = 0; it < cfg.iterations; it++) {
+	apply_pattern(cfg, slice, n, order);
+	bar.wait();
+	// worker 0 may be checkpointing
+	bar.wait();
+    }
+}
+
+static void diff_stats(struct acfte_stats &after, const struct acfte_stats &before) {
+    // occupancy gauges and the dedup page counts of the last checkpoint are not cumulative
+    after.checkpoints -= before.checkpoints;
+    for (unsigned int t = 0; t < ACFTE_FAULT_TYPES; t++) {
+	after.faults[t] -= before.faults[t];
+	for (unsigned int b = 0; b < ACFTE_HIST_BUCKETS; b++)
+	    after.fault_latency[t][b] -= before.fault_latency[t][b];
+    }
+    for (unsigned int b = 0; b < ACFTE_HIST_BUCKETS; b++)
+	after.flush_latency[b] -= before.flush_latency[b];
+    after.pages_flushed -= before.pages_flushed;
+    after.bytes_written -= before.bytes_written;
+    after.setup_ns -= before.setup_ns;
+    after.dedup_local_ns -= before.dedup_local_ns;
+    after.dedup_global_ns -= before.dedup_global_ns;
+    after.pages_speculated -= before.pages_speculated;
+}
+
+static unsigned long long ckpt_start;
+
+static void checkpoint_done(int id, void *arg) {
+    result_t *res = (result_t *)arg;
+    res->ckpt_ns += now_ns() - ckpt_start;
+    res->checkpoints++;
+}
+
+static int last_ckpt = -1;
+
+// returns once the pages are protected, the flush overlaps with the next iterations
+static void run_checkpoint(result_t &res) {
+    if (last_ckpt >= 0)
+	checkpoint_wait(last_ckpt);
+    ckpt_start = now_ns();
+    last_ckpt = checkpoint_async(&checkpoint_done, &res);
+}
+
+// leaves the interval to the checkpointer, which needs CKPT_MTBF among the flags
+static void run_checkpoint_if_due(result_t &res) {
+    if (last_ckpt >= 0 && !checkpoint_test(last_ckpt))
+	return;
+    ckpt_start = now_ns();
+    int id = checkpoint_if_due(&checkpoint_done, &res);
+    if (id >= 0)
+	last_ckpt = id;
+}
+
+static void run_config(const config_t &cfg, bool tracked, result_t &res) {
+    memset(&res, 0, sizeof(res));
+    if (tracked) {
+	std::vector<std::string> assignments;
+	split(cfg.flags, ',', assignments);
+	for (unsigned int i = 0; i < assignments.size(); i++) {
+	    size_t eq = assignments[i].find('=');
+	    if (eq != std::string::npos)
+		setenv(assignments[i].substr(0, eq).c_str(), assignments[i].substr(eq + 1).c_str(), 1);
+	}
+	start_checkpointer();
+    }
+    char *buff = (char *)malloc_protected(cfg.size);
+    if (buff == NULL) {
+	std::cerr << "could not allocate buffer of size " << cfg.size << std::endl;
+	_exit(1);
+    }
+    memset(buff, 0, cfg.size);
+    // first checkpoint captures the initial state, later ones are incremental if enabled
+    if (tracked)
+	run_checkpoint(res);
+    checkpoint_wait(last_ckpt);
+    struct acfte_stats before;
+    memset(&before, 0, sizeof(before));
+    get_checkpoint_stats(&before);
+    res.ckpt_ns = res.checkpoints = 0;
+
+    size_t pages = cfg.size / cfg.page_size, per_thread = pages / cfg.threads;
+    boost::barrier bar(cfg.threads);
+    boost::thread_group group;
+
+    unsigned long long start = now_ns(), start_faults = minor_faults();
+    for (unsigned int t = 1; t < cfg.threads; t++)
+	group.create_thread(boost::bind(&worker, boost::cref(cfg), buff + t * per_thread * cfg.page_size,
+					t + 1 == cfg.threads ? pages - t * per_thread : per_thread,
+					t, boost::ref(bar)));
+    // the main thread is worker 0 and starts the checkpoints while the others wait at the barrier
+    std::vector<size_t> order;
+    generate_order(cfg, 1, per_thread, order);
+    for (unsigned int it = 0; it < cfg.iterations; it++) {
+	apply_pattern(cfg, buff, per_thread, order);
+	bar.wait();
+	if (tracked && cfg.interval == AUTO_INTERVAL)
+	    run_checkpoint_if_due(res);
+	else if (tracked && cfg.interval > 0 && (it + 1) % cfg.interval == 0)
+	    run_checkpoint(res);
+	bar.wait();
+    }
+    group.join_all();
+    if (last_ckpt >= 0)
+	checkpoint_wait(last_ckpt);
+    res.run_ns = now_ns() - start;
+    res.minor_faults = minor_faults() - start_faults;
+
+    get_checkpoint_stats(&res.stats);
+    diff_stats(res.stats, before);
+    if (tracked)
+	terminate_checkpointer();
+}
+
+static bool run_child(const config_t &cfg, bool tracked, result_t &res) {
+    int fds[2];
+    if (pipe(fds) == -1)
+	return false;
+    pid_t pid = fork();
+    if (pid == 0) {
+	close(fds[0]);
+	run_config(cfg, tracked, res);
+	ssize_t ret = write(fds[1], &res, sizeof(res));
+	_exit(ret == sizeof(res) ? 0 : 1);
+    }
+    close(fds[1]);
+    size_t progress = 0;
+    while (pid > 0 && progress < sizeof(res)) {
+	ssize_t ret = read(fds[0], (char *)&res + progress, sizeof(res) - progress);
+	if (ret <= 0)
+	    break;
+	progress += ret;
+    }
+    close(fds[0]);
+    int status;
+    if (pid > 0)
+	waitpid(pid, &status, 0);
+    return pid > 0 && progress == sizeof(res) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// upper bound of the log2 bucket that contains the given percentile
+static unsigned long long percentile(const unsigned long long *hist, unsigned long long total, double pct) {
+    if (total == 0)
+	return 0;
+    unsigned long long rank = std::min(total - 1, (unsigned long long)(total * pct / 100.0)), seen = 0;
+    for (unsigned int b = 0; b < ACFTE_HIST_BUCKETS; b++) {
+	seen += hist[b];
+	if (seen > rank)
+	    return 2ULL << b;
+    }
+    return 2ULL << (ACFTE_HIST_BUCKETS - 1);
+}
+
+static void print_result(std::ostream &out, const config_t &cfg, const result_t &base, const result_t &res) {
+    const struct acfte_stats &st = res.stats;
+    unsigned long long hist[ACFTE_HIST_BUCKETS], faults = 0;
+    memset(hist, 0, sizeof(hist));
+    for (unsigned int t = 0; t < ACFTE_FAULT_TYPES; t++) {
+	faults += st.faults[t];
+	for (unsigned int b = 0; b < ACFTE_HIST_BUCKETS; b++)
+	    hist[b] += st.fault_latency[t][b];
+    }
+    double run_s = res.run_ns / 1e9, base_s = base.run_ns / 1e9;
+    double flush_s = res.ckpt_ns > st.setup_ns ? (res.ckpt_ns - st.setup_ns) / 1e9 : 0;
+
+    out << "    {\"pattern\": \"" << pattern_names[cfg.pattern] << "\", \"threads\": " << cfg.threads
+	<< ", \"interval\": ";
+    if (cfg.interval == AUTO_INTERVAL)
+	out << "\"auto\"";
+    else
+	out << cfg.interval;
+    out << ", \"flags\": \"" << cfg.flags << "\",\n"
+	<< "     \"baseline_s\": " << base_s << ", \"tracked_s\": " << run_s
+	<< ", \"slowdown\": " << (base_s > 0 ? run_s / base_s : 0) << ",\n"
+	<< "     \"checkpoints\": " << res.checkpoints << ", \"faults\": " << faults
+	<< ", \"fault_rate\": " << (run_s > 0 ? faults / run_s : 0)
+	<< ", \"kernel_faults\": " << res.minor_faults
+	<< ", \"baseline_kernel_faults\": " << base.minor_faults
+	<< ", \"pages_speculated\": " << st.pages_speculated << ",\n"
+	<< "     \"faults_by_type\": {";
+    for (unsigned int t = 0; t < ACFTE_FAULT_TYPES; t++)
+	out << (t ? ", " : "") << "\"" << fault_names[t] << "\": " << st.faults[t];
+    out << "},\n"
+	<< "     \"fault_latency_ns\": {\"p50\": " << percentile(hist, faults, 50)
+	<< ", \"p90\": " << percentile(hist, faults, 90)
+	<< ", \"p99\": " << percentile(hist, faults, 99)
+	<< ", \"max\": " << percentile(hist, faults, 100) << "},\n"
+	<< "     \"setup_ms\": " << (res.checkpoints ? st.setup_ns / 1e6 / res.checkpoints : 0)
+	<< ", \"checkpoint_ms\": " << (res.checkpoints ? res.ckpt_ns / 1e6 / res.checkpoints : 0)
+	<< ", \"bytes_written\": " << st.bytes_written
+	<< ", \"flush_mb_s\": " << (flush_s > 0 ? st.bytes_written / flush_s / (1 << 20) : 0)
+	<< ", \"cow_peak_pages\": " << st.cow_pages_peak
+	<< ", \"spill_peak_pages\": " << st.spill_pages_peak << "}";
+}
+
+static void usage(const char *name) {
+    std::cerr << "Usage: " << name << " [-s region_mb] [-i iterations] [-p patterns] [-t threads] [-c intervals]\n"
+	      << "\t[-f flag_sets] [-w touch_bytes] [-S stride_pages] [-H hot_percent] [-o output.json]\n"
+	      << "patterns: comma separated list of sequential,strided,interleaved,random,hotcold,stencil\n"
+	      << "threads, intervals: comma separated lists; an interval of k checkpoints every k iterations,\n"
+	      << "\tauto calls checkpoint_if_due() every iteration (set CKPT_MTBF in the flag sets)\n"
+	      << "flag_sets: '|' separated sets of comma separated VAR=value settings for the checkpointer,\n"
+	      << "\tthe default compares full and incremental write tracking with fork snapshots" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    config_t cfg;
+    std::string patterns = "sequential,strided,interleaved,random,hotcold,stencil", threads = "1", intervals = "2";
+    std::string flag_sets = "INCREMENTAL_FLAG=false|INCREMENTAL_FLAG=true|FORK_SNAPSHOT_FLAG=true", output = "";
+    unsigned long size_mb = 256;
+    int opt;
+
+    cfg.page_size = getpagesize();
+    cfg.iterations = 8;
+    cfg.touch = 64;
+    cfg.stride = 16;
+    cfg.hot_percent = 10;
+    while ((opt = getopt(argc, argv, "s:i:p:t:c:f:w:S:H:o:h")) != -1) {
+	switch (opt) {
+	case 's': size_mb = strtoul(optarg, NULL, 10); break;
+	case 'i': cfg.iterations = strtoul(optarg, NULL, 10); break;
+	case 'p': patterns = optarg; break;
+	case 't': threads = optarg; break;
+	case 'c': intervals = optarg; break;
+	case 'f': flag_sets = optarg; break;
+	case 'w': cfg.touch = std::min<size_t>(strtoul(optarg, NULL, 10), cfg.page_size); break;
+	case 'S': cfg.stride = std::max(1UL, strtoul(optarg, NULL, 10)); break;
+	case 'H': cfg.hot_percent = std::min(99UL, std::max(1UL, strtoul(optarg, NULL, 10))); break;
+	case 'o': output = optarg; break;
+	default: usage(argv[0]); return 1;
+	}
+    }
+    cfg.size = size_mb << 20;
+
+    std::vector<std::string> pattern_list, thread_list, interval_list, flag_list;
+    split(patterns, ',', pattern_list);
+    split(threads, ',', thread_list);
+    split(intervals, ',', interval_list);
+    split(flag_sets, '|', flag_list);
+
+    std::ofstream file;
+    if (output != "") {
+	file.open(output.c_str());
+	if (!file.good()) {
+	    std::cerr << "cannot open " << output << std::endl;
+	    return 1;
+	}
+    }
+    std::ostream &out = output != "" ? file : std::cout;
+    out << "{\"benchmark\": \"bench_suite\", \"page_size\": " << cfg.page_size
+	<< ", \"region_mb\": " << size_mb << ", \"iterations\": " << cfg.iterations
+	<< ", \"touch_bytes\": " << cfg.touch << ", \"stride\": " << cfg.stride
+	<< ", \"hot_percent\": " << cfg.hot_percent << ",\n \"runs\": [\n";
+
+    bool first = true;
+    int failures = 0;
+    for (unsigned int p = 0; p < pattern_list.size(); p++) {
+	for (cfg.pattern = 0; cfg.pattern < PATTERN_TYPES; cfg.pattern++)
+	    if (pattern_list[p] == pattern_names[cfg.pattern])
+		break;
+	if (cfg.pattern == PATTERN_TYPES) {
+	    std::cerr << "unknown pattern " << pattern_list[p] << ", skipping" << std::endl;
+	    continue;
+	}
+	for (unsigned int t = 0; t < thread_list.size(); t++) {
+	    cfg.threads = std::max(1UL, strtoul(thread_list[t].c_str(), NULL, 10));
+	    for (unsigned int c = 0; c < interval_list.size(); c++) {
+		if (interval_list[c] == "auto")
+		    cfg.interval = AUTO_INTERVAL;
+		else
+		    cfg.interval = strtoul(interval_list[c].c_str(), NULL, 10);
+		cfg.flags = "";
+		result_t base;
+		if (!run_child(cfg, false, base)) {
+		    std::cerr << "baseline run of " << pattern_list[p] << " failed" << std::endl;
+		    failures++;
+		    continue;
+		}
+		for (unsigned int f = 0; f < flag_list.size(); f++) {
+		    cfg.flags = flag_list[f];
+		    std::cerr << "running " << pattern_list[p] << ", threads = " << cfg.threads
+			      << ", interval = " << interval_list[c] << ", flags = " << cfg.flags << std::endl;
+		    result_t res;
+		    if (!run_child(cfg, true, res)) {
+			std::cerr << "tracked run failed" << std::endl;
+			failures++;
+			continue;
+		    }
+		    if (!first)
+			out << ",\n";
+		    print_result(out, cfg, base, res);
+		    first = false;
+		}
+	    }
+	}
+    }
+    out << "\n ]}" << std::endl;
+
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,426 @@
+#include "lib/ckpt_trace.hpp"
+#include "lib/ac_fte.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <map>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+
+extern "C" {
+#include <getopt.h>
+}
+
+// Replays a trace recorded with CKPT_TRACE_PATH against a model of the checkpointer: the
+// application threads are replayed in recorded order, each delayed by the waits it gets in
+// the model, and the writer commits a page every page_size / bandwidth. Only first writes
+// are visible in a trace of full checkpoints, INCREMENTAL_FLAG traces see all of them; pages
+// handled ahead of a fault stream count as written when they were handled. Setup time and
+// the cost of the faults themselves are not modelled, learned order falls back to access order.
+
+typedef ckpt_trace::record_t record_t;
+
+enum order_t {
+    ADDRESS, ACCESS, ORDER_TYPES
+};
+
+static const char *order_names[ORDER_TYPES] = {
+    "address", "access"
+};
+
+// access types in the order the checkpointer ranks them
+enum access_t {
+    ACCESS_WAIT = 1, ACCESS_COW, ACCESS_AFTER, ACCESS_DELAYED
+};
+
+static const char *fault_names[ACFTE_FAULT_TYPES] = {
+    "wait", "cow", "spill", "after", "delayed"
+};
+
+struct policy_t {
+    double bandwidth;
+    unsigned long long cow_pages;
+    unsigned int urgent_window;
+    int order;
+    bool incremental;
+};
+
+struct outcome_t {
+    unsigned long long faults[ACFTE_FAULT_TYPES];
+    unsigned long long checkpoints, pages_written, wait_ns, ckpt_ns, max_delay_ns;
+};
+
+struct touched_t {
+    boost::uint64_t addr;
+    char type;
+};
+
+static bool address_comparator(const touched_t &t1, const touched_t &t2) {
+    return t1.addr < t2.addr;
+}
+
+static bool type_comparator(const touched_t &t1, const touched_t &t2) {
+    return t1.type < t2.type;
+}
+
+static bool stamp_comparator(const record_t &r1, const record_t &r2) {
+    return r1.stamp < r2.stamp;
+}
+
+class replay_t {
+private:
+    static const char SCHEDULED = 1, COPIED = 2, COMMITTED = 3;
+
+    const policy_t &policy;
+    boost::uint64_t page_size;
+    double page_ns;
+    outcome_t &out;
+
+    std::set<boost::uint64_t> tracked;
+    boost::unordered_map<boost::uint64_t, char> state;
+    std::vector<boost::uint64_t> order;
+    unsigned int next_page;
+    std::deque<boost::uint64_t> urgent;
+    bool active;
+    double writer, ckpt_start;
+    unsigned long long cow_used, to_commit;
+    std::vector<touched_t> touched;
+    boost::unordered_set<boost::uint64_t> touched_set;
+    std::map<unsigned int, double> delay;
+
+    void commit(boost::uint64_t addr) {
+	writer += page_ns;
+	state[addr] = COMMITTED;
+	out.pages_written++;
+	if (--to_commit == 0) {
+	    active = false;
+	    out.checkpoints++;
+	    out.ckpt_ns += writer - ckpt_start;
+	}
+    }
+
+    bool pending(boost::uint64_t addr) {
+	boost::unordered_map<boost::uint64_t, char>::iterator s_it = state.find(addr);
+	return s_it != state.end() && s_it->second != COMMITTED;
+    }
+
+    void flush_urgent() {
+	while (active && !urgent.empty()) {
+	    boost::uint64_t addr = urgent.front();
+	    urgent.pop_front();
+	    if (pending(addr))
+		commit(addr);
+	}
+    }
+
+    // let the writer commit everything it would have by time t
+    void advance(double t) {
+	while (active && writer + page_ns <= t) {
+	    flush_urgent();
+	    while (next_page < order.size() && !pending(order[next_page]))
+		next_page++;
+	    if (!active || next_page == order.size())
+		break;
+	    commit(order[next_page++]);
+	}
+	// an idle writer waits for the next checkpoint, a busy one is halfway through a page
+	if (!active)
+	    writer = std::max(writer, t);
+    }
+
+    void finish(double t) {
+	advance(t);
+	while (active)
+	    advance(writer + page_ns);
+    }
+
+public:
+    replay_t(const policy_t &p, boost::uint64_t ps, outcome_t &o) :
+	policy(p), page_size(ps), page_ns(ps / p.bandwidth * 1e9), out(o), next_page(0),
+	active(false), writer(0), ckpt_start(0), cow_used(0), to_commit(0) {
+	memset(&out, 0, sizeof(out));
+    }
+
+    // returns when the application resumes
+    double begin(double t) {
+	// checkpoint_async() waits for the previous checkpoint
+	finish(t);
+	t = writer;
+	order.clear();
+	state.clear();
+	urgent.clear();
+	if (policy.order == ACCESS)
+	    std::stable_sort(touched.begin(), touched.end(), &type_comparator);
+	else
+	    std::sort(touched.begin(), touched.end(), &address_comparator);
+	// touched is flushed back to front
+	if (policy.incremental || policy.order == ACCESS)
+	    for (int i = touched.size() - 1; i >= 0; i--)
+		if (tracked.count(touched[i].addr) && state.insert(std::make_pair(touched[i].addr, SCHEDULED)).second)
+		    order.push_back(touched[i].addr);
+	if (!policy.incremental)
+	    for (std::set<boost::uint64_t>::iterator p_it = tracked.begin(); p_it != tracked.end(); p_it++)
+		if (state.insert(std::make_pair(*p_it, SCHEDULED)).second)
+		    order.push_back(*p_it);
+	touched.clear();
+	touched_set.clear();
+	next_page = 0;
+	cow_used = 0;
+	to_commit = order.size();
+	active = to_commit > 0;
+	ckpt_start = t;
+	return t;
+    }
+
+    void fault(boost::uint64_t addr, unsigned int thread, double t) {
+	if (!tracked.count(addr))
+	    return;
+	advance(t);
+	char type;
+	boost::unordered_map<boost::uint64_t, char>::iterator s_it = state.find(addr);
+	if (active && s_it != state.end() && s_it->second == SCHEDULED) {
+	    if (cow_used < policy.cow_pages) {
+		cow_used++;
+		s_it->second = COPIED;
+		out.faults[ACFTE_FAULT_COW]++;
+		type = ACCESS_COW;
+	    } else {
+		// blocked until the writer gets to it, along with the window behind it
+		urgent.push_back(addr);
+		for (unsigned int i = 1; i <= policy.urgent_window; i++)
+		    urgent.push_back(addr + i * page_size);
+		double start = writer;
+		flush_urgent();
+		double wait = std::max(0.0, start + page_ns - t);
+		delay[thread] += wait;
+		out.wait_ns += wait;
+		out.faults[ACFTE_FAULT_WAIT]++;
+		type = ACCESS_WAIT;
+	    }
+	} else if (touched_set.count(addr) || (!policy.incremental && (active || s_it != state.end())))
+	    // already written in this epoch, or writable again after its commit
+	    return;
+	else if (active) {
+	    out.faults[ACFTE_FAULT_AFTER]++;
+	    type = ACCESS_AFTER;
+	} else {
+	    if (!policy.incremental)
+		return;
+	    out.faults[ACFTE_FAULT_DELAYED]++;
+	    type = ACCESS_DELAYED;
+	}
+	if (touched_set.insert(addr).second) {
+	    touched_t entry = {addr, type};
+	    touched.push_back(entry);
+	}
+    }
+
+    void run(const std::vector<record_t> &trace) {
+	for (unsigned int i = 0; i < trace.size(); i++) {
+	    const record_t &r = trace[i];
+	    double t = r.stamp + delay[r.thread];
+	    switch (r.event) {
+	    case ckpt_trace::REGION_ADD:
+		for (unsigned int j = 0; j < r.value; j++)
+		    tracked.insert(r.addr + j * page_size);
+		break;
+	    case ckpt_trace::REGION_REMOVE:
+		for (unsigned int j = 0; j < r.value; j++)
+		    tracked.erase(r.addr + j * page_size);
+		break;
+	    case ckpt_trace::CKPT_BEGIN:
+		delay[r.thread] += begin(t) - t;
+		break;
+	    case ckpt_trace::FAULT:
+		fault(r.addr, r.thread, t);
+		break;
+	    }
+	}
+	if (!trace.empty())
+	    finish(trace.back().stamp);
+	for (std::map<unsigned int, double>::iterator d_it = delay.begin(); d_it != delay.end(); d_it++)
+	    out.max_delay_ns = std::max(out.max_delay_ns, (unsigned long long)d_it->second);
+    }
+};
+
+static void split(const std::string &str, char sep, std::vector<std::string> &out) {
+    std::stringstream ss(str);
+    std::string item;
+    while (std::getline(ss, item, sep))
+	if (item != "")
+	    out.push_back(item);
+}
+
+static void print_outcome(std::ostream &out, const outcome_t &res) {
+    out << "\"checkpoints\": " << res.checkpoints
+	<< ", \"checkpoint_ms\": " << (res.checkpoints ? res.ckpt_ns / 1e6 / res.checkpoints : 0)
+	<< ", \"pages_written\": " << res.pages_written
+	<< ", \"wait_ms\": " << res.wait_ns / 1e6
+	<< ", \"max_thread_delay_ms\": " << res.max_delay_ns / 1e6 << ",\n     \"faults_by_type\": {";
+    for (unsigned int t = 0; t < ACFTE_FAULT_TYPES; t++)
+	out << (t ? ", " : "") << "\"" << fault_names[t] << "\": " << res.faults[t];
+    out << "}";
+}
+
+static void usage(const char *name) {
+    std::cerr << "Usage: " << name << " [-b bandwidths_mb_s] [-c cow_pages] [-O orders] [-u urgent_window]\n"
+	      << "\t[-m full|incremental] [-o output.json] trace_file\n"
+	      << "bandwidths, cow_pages, orders: comma separated lists, every combination is replayed;\n"
+	      << "\tdefaults are the bandwidth achieved in the trace and the recorded budget and policy\n"
+	      << "orders: address,access" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    std::string bandwidths = "", cow_list = "", orders = "", mode = "", output = "";
+    unsigned int urgent_window = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:c:O:u:m:o:h")) != -1) {
+	switch (opt) {
+	case 'b': bandwidths = optarg; break;
+	case 'c': cow_list = optarg; break;
+	case 'O': orders = optarg; break;
+	case 'u': urgent_window = strtoul(optarg, NULL, 10); break;
+	case 'm': mode = optarg; break;
+	case 'o': output = optarg; break;
+	default: usage(argv[0]); return 1;
+	}
+    }
+    if (optind != argc - 1) {
+	usage(argv[0]);
+	return 1;
+    }
+
+    std::ifstream in(argv[optind], std::ios::binary);
+    if (!in.good()) {
+	std::cerr << "cannot open " << argv[optind] << std::endl;
+	return 1;
+    }
+    std::vector<record_t> trace;
+    record_t r;
+    while (in.read((char *)&r, sizeof(r)))
+	trace.push_back(r);
+    // threads store their events in the ring in nearly, but not exactly, time order
+    std::stable_sort(trace.begin(), trace.end(), &stamp_comparator);
+
+    // what the recorded run did
+    boost::uint64_t page_size = 0, recorded_cow = 0, lost = 0, begin_stamp = 0;
+    boost::uint8_t flags = 0;
+    outcome_t recorded;
+    memset(&recorded, 0, sizeof(recorded));
+    unsigned long long speculated = 0;
+    for (unsigned int i = 0; i < trace.size(); i++)
+	switch (trace[i].event) {
+	case ckpt_trace::TRACE_START:
+	    page_size = trace[i].value;
+	    recorded_cow = trace[i].addr;
+	    flags = trace[i].type;
+	    break;
+	case ckpt_trace::TRACE_LOST:
+	    lost += trace[i].value;
+	    break;
+	case ckpt_trace::CKPT_BEGIN:
+	    begin_stamp = trace[i].stamp;
+	    break;
+	case ckpt_trace::CKPT_END:
+	    recorded.checkpoints++;
+	    recorded.ckpt_ns += trace[i].stamp - begin_stamp;
+	    recorded.pages_written += trace[i].value;
+	    break;
+	case ckpt_trace::FAULT:
+	    if (trace[i].type == ckpt_trace::FAULT_SPECULATED)
+		speculated++;
+	    else if (trace[i].type < ACFTE_FAULT_TYPES) {
+		recorded.faults[trace[i].type]++;
+		if (trace[i].type == ACFTE_FAULT_WAIT)
+		    recorded.wait_ns += trace[i].value;
+	    }
+	    break;
+	}
+    if (page_size == 0) {
+	std::cerr << "no trace header in " << argv[optind] << std::endl;
+	return 1;
+    }
+    double recorded_bw = recorded.ckpt_ns > 0 ? recorded.pages_written * page_size / (recorded.ckpt_ns / 1e9) : 0;
+
+    std::vector<std::string> bw_list, cow_pages_list, order_list;
+    split(bandwidths, ',', bw_list);
+    split(cow_list, ',', cow_pages_list);
+    split(orders, ',', order_list);
+    if (bw_list.empty()) {
+	if (recorded_bw == 0) {
+	    std::cerr << "no checkpoint in the trace to take the bandwidth from, use -b" << std::endl;
+	    return 1;
+	}
+	std::ostringstream ss;
+	ss << recorded_bw / (1 << 20);
+	bw_list.push_back(ss.str());
+    }
+    if (cow_pages_list.empty()) {
+	std::ostringstream ss;
+	ss << recorded_cow;
+	cow_pages_list.push_back(ss.str());
+    }
+    if (order_list.empty())
+	order_list.push_back(order_names[flags & (ckpt_trace::TRACE_ACCESS_ORDER | ckpt_trace::TRACE_LEARNED_ORDER) ? ACCESS : ADDRESS]);
+
+    std::ofstream file;
+    if (output != "") {
+	file.open(output.c_str());
+	if (!file.good()) {
+	    std::cerr << "cannot open " << output << std::endl;
+	    return 1;
+	}
+    }
+    std::ostream &out = output != "" ? file : std::cout;
+    out << "{\"trace\": \"" << argv[optind] << "\", \"events\": " << trace.size()
+	<< ", \"lost_events\": " << lost << ", \"page_size\": " << page_size
+	<< ", \"speculated_pages\": " << speculated << ",\n \"recorded\": {\"bandwidth_mb_s\": "
+	<< recorded_bw / (1 << 20) << ", \"cow_pages\": " << recorded_cow
+	<< ", \"incremental\": " << ((flags & ckpt_trace::TRACE_INCREMENTAL) ? "true" : "false") << ",\n     ";
+    print_outcome(out, recorded);
+    out << "},\n \"runs\": [\n";
+
+    bool first = true;
+    for (unsigned int b = 0; b < bw_list.size(); b++)
+	for (unsigned int c = 0; c < cow_pages_list.size(); c++)
+	    for (unsigned int o = 0; o < order_list.size(); o++) {
+		policy_t policy;
+		policy.bandwidth = strtod(bw_list[b].c_str(), NULL) * (1 << 20);
+		policy.cow_pages = strtoull(cow_pages_list[c].c_str(), NULL, 10);
+		policy.urgent_window = urgent_window;
+		policy.incremental = mode != "" ? mode == "incremental" : (flags & ckpt_trace::TRACE_INCREMENTAL);
+		for (policy.order = 0; policy.order < ORDER_TYPES; policy.order++)
+		    if (order_list[o] == order_names[policy.order])
+			break;
+		if (policy.bandwidth <= 0 || policy.order == ORDER_TYPES) {
+		    std::cerr << "skipping bandwidth " << bw_list[b] << ", order " << order_list[o] << std::endl;
+		    continue;
+		}
+		outcome_t res;
+		replay_t replay(policy, page_size, res);
+		replay.run(trace);
+		if (!first)
+		    out << ",\n";
+		first = false;
+		out << "    {\"bandwidth_mb_s\": " << policy.bandwidth / (1 << 20)
+		    << ", \"cow_pages\": " << policy.cow_pages << ", \"order\": \"" << order_names[policy.order]
+		    << "\", \"urgent_window\": " << policy.urgent_window
+		    << ", \"incremental\": " << (policy.incremental ? "true" : "false") << ",\n     ";
+		print_outcome(out, res);
+		out << "}";
+	    }
+    out << "\n ]}" << std::endl;
+
+    return 0;
+}